@@ -5,26 +5,42 @@
 #include <strsafe.h>
 #include <tchar.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <math.h>
 #include <time.h>
 #include <commctrl.h>
 #include <algorithm>
+#include <vector>
 #include <comdef.h>
 #include <Wbemidl.h>
+#include <setupapi.h>
+#include <initguid.h>
+#include <devguid.h>
+#include <batclass.h>
+#include <dbt.h>
+#include <intrin.h>
+#if defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+#include "BatteryStatusShm.h"
 #pragma comment(lib, "user32.lib")
 #pragma comment(lib, "shell32.lib")
 #pragma comment(lib, "PowrProf.lib")
 #pragma comment(lib, "advapi32.lib")
 #pragma comment(lib, "comctl32.lib")
 #pragma comment(lib, "wbemuuid.lib")
+#pragma comment(lib, "setupapi.lib")
 
 #define WM_TRAYICON      (WM_USER + 1)
+#define WM_CONFIGCHANGED (WM_USER + 2)
 #define ID_TRAYICON      1001
-#define IDT_TIMER        2001
-#define IDT_TOOLBAR      2002
+#define IDT_SAMPLE       2002
+#define IDT_CONFIG_SAVE  2003
+#define IDT_CHECKPOINT   2004
 #define IDM_EXIT         40001
 #define IDM_SHOW_TOOLBAR 40002
 #define IDM_AUTOSTART    40003
+#define IDM_EXPORT       40004
 
 HINSTANCE hInst;
 NOTIFYICONDATA nid = { 0 };
@@ -37,6 +53,12 @@ bool dragging = false;
 POINT dragOffset = { 0, 0 };
 TCHAR iniPath[MAX_PATH] = { 0 };
 TCHAR dbPath[MAX_PATH] = { 0 };
+TCHAR logPath[MAX_PATH] = { 0 };
+HANDLE hLiveMapping = NULL;
+BatteryLiveSegment* liveSegment = nullptr;
+int liveWearTenths = -1;
+int dischargeSampleCount = 0;
+int chargeSampleCount = 0;
 
 #define MAX_SAMPLES 40
 
@@ -49,13 +71,124 @@ struct BatterySample {
     time_t t;
 };
 
+// Optional readings from the battery driver; a field is meaningful only when
+// its bit is set in present.
+#define TELEMETRY_VOLTAGE 0x01
+#define TELEMETRY_CURRENT 0x02
+#define TELEMETRY_TEMP    0x04
+#define TELEMETRY_CYCLES  0x08
+#define TELEMETRY_CHARGE  0x10
+#define TELEMETRY_FULL    0x20
+#define TELEMETRY_DESIGN  0x40
+
+struct BatteryTelemetry {
+    unsigned int present;
+    int milliVolts;
+    int milliAmps;          // positive while charging
+    int deciCelsius;
+    int cycleCount;
+    int chargeMilliWattHours;
+    int fullMilliWattHours;
+    int designMilliWattHours;
+};
+
+#define TELEMETRY_FIELDS     7
+#define TELEMETRY_RECORD_MAX (1 + TELEMETRY_FIELDS * 5)
+#define TELEMETRY_POOL       1024
+
+// Telemetry kept alongside one history ring. A record is the presence byte
+// followed by a zigzag varint per present field, so absent fields take no
+// space and a full reading packs into about 19 bytes. Records are appended to
+// a circular pool; a slot whose record has been overwritten reads as empty.
+struct TelemetryRing {
+    unsigned int head;                  // bytes appended so far
+    unsigned int start[MAX_SAMPLES];    // head + 1 where each slot's record begins, 0 if none
+    unsigned char pool[TELEMETRY_POOL];
+};
+
+#define CURVE_BUCKETS 100
+#define CURVE_MAX_GAP 300
+
+// Learned minutes needed to gain one percent on AC, indexed by the percent the
+// step starts from. Captures the slowdown of the constant-voltage phase.
+struct ChargeCurve {
+    float minutesPerPercent[CURVE_BUCKETS];
+    unsigned short observations[CURVE_BUCKETS];
+    int stepPercent;
+    time_t stepT;
+    time_t lastT;
+};
+
+#define ENERGY_MAX_GAP 600
+
+// Battery energy integrated over one period (a session, day or week).
+struct EnergyPeriod {
+    time_t start;        // 0 while the period is empty
+    double milliWattHours;
+    double seconds;      // time covered by integration
+    double gapSeconds;   // time on battery that could not be integrated
+};
+
+// Constant-size rollups of the trapezoidal integral of power on battery.
+struct EnergyLedger {
+    EnergyPeriod session;
+    EnergyPeriod lastSession;
+    EnergyPeriod day;
+    EnergyPeriod lastDay;
+    EnergyPeriod week;
+    EnergyPeriod lastWeek;
+    int lastMilliWatts;
+    int lastAc;
+    time_t lastT;
+};
+
+#define HOURS_PER_WEEK 168
+
+// Hour-of-week habits: how often AC gets plugged in during each hour and the
+// average draw on battery. Both decay by USAGE_DECAY every week so the model
+// follows schedule changes.
+struct UsageModel {
+    float plugIns[HOURS_PER_WEEK];
+    float drawMilliWattSeconds[HOURS_PER_WEEK];
+    float drawSeconds[HOURS_PER_WEEK];
+    float weeks;            // decayed number of weeks observed
+    time_t weekStart;
+    int lastAc;
+    time_t lastT;
+};
+
+// Equivalent full cycles counted from charge throughput, plus a running least
+// squares fit of full-charge capacity against cycles for end-of-life projection.
+struct WearLedger {
+    double cycles;
+    int lastChargeMilliWattHours;  // 0 when the previous sample had no charge reading
+    int lastPercent;
+    int fullMilliWattHours;
+    int designMilliWattHours;
+    time_t firstT;
+    double firstCycles;
+    time_t lastRecordT;
+    double n, sx, sy, sxx, sxy;    // x = cycles, y = full-charge capacity (mWh)
+};
+
+// History.bin is append-only: sections added later go at the end, so a file
+// written by an older build loads with the newer sections zeroed.
 struct BatteryDB {
     int idxDischarge;
     BatterySample discharge[MAX_SAMPLES];
     int idxCharge;
     BatterySample charge[MAX_SAMPLES];
+    ChargeCurve curve;
+    EnergyLedger energy;
+    TelemetryRing dischargeTelemetry;  // slots parallel to discharge
+    TelemetryRing chargeTelemetry;     // slots parallel to charge
+    UsageModel usage;
+    WearLedger wear;
 };
 
+ChargeCurve chargeCurve = { 0 };
+bool chargeCurveLoaded = false;
+
 void GetDbPath() {
     if (!dbPath[0]) {
         GetModuleFileName(NULL, dbPath, MAX_PATH);
@@ -65,6 +198,24 @@ void GetDbPath() {
     }
 }
 
+void GetIniPath() {
+    if (!iniPath[0]) {
+        GetModuleFileName(NULL, iniPath, MAX_PATH);
+        TCHAR* p = _tcsrchr(iniPath, _T('\\'));
+        if (p) *(p + 1) = 0;
+        _tcscat_s(iniPath, MAX_PATH, _T("BatteryStatus.ini"));
+    }
+}
+
+void GetLogPath() {
+    if (!logPath[0]) {
+        GetModuleFileName(NULL, logPath, MAX_PATH);
+        TCHAR* p = _tcsrchr(logPath, _T('\\'));
+        if (p) *(p + 1) = 0;
+        _tcscat_s(logPath, MAX_PATH, _T("BatteryStatus.log"));
+    }
+}
+
 bool IsBatterySampleValid(int percent, int ac, int rate, int milliWatts, int flag) {
     if (percent < 1 || percent > 100 || percent == 255)
         return false;
@@ -75,24 +226,817 @@ bool IsBatterySampleValid(int percent, int ac, int rate, int milliWatts, int fla
     return true;
 }
 
-void LogBatterySample(int percent, int ac, int rate, int milliWatts, int systemFlag) {
-    if (!IsBatterySampleValid(percent, ac, rate, milliWatts, systemFlag))
-        return;
+bool LoadBatteryDB(BatteryDB* db) {
+    memset(db, 0, sizeof(BatteryDB));
     GetDbPath();
     FILE* f;
-    BatteryDB db = { 0 };
-    bool exists = false;
-    _tfopen_s(&f, dbPath, _T("r+b"));
-    if (f) {
-        fread(&db, sizeof(BatteryDB), 1, f);
-        fclose(f);
-        exists = true;
+    _tfopen_s(&f, dbPath, _T("rb"));
+    if (!f) return false;
+    size_t n = fread(db, 1, sizeof(BatteryDB), f);
+    fclose(f);
+    return n >= offsetof(BatteryDB, curve);
+}
+
+// Written to a temp file and moved into place: a crash mid-write must not
+// truncate History.bin, or the next load would zero the learned sections.
+void SaveBatteryDB(const BatteryDB* db) {
+    GetDbPath();
+    TCHAR tmpPath[MAX_PATH];
+    StringCchPrintf(tmpPath, MAX_PATH, _T("%s.tmp"), dbPath);
+    FILE* f;
+    _tfopen_s(&f, tmpPath, _T("wb"));
+    if (!f) return;
+    size_t written = fwrite(db, sizeof(BatteryDB), 1, f);
+    if (fclose(f) == 0 && written == 1)
+        MoveFileEx(tmpPath, dbPath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+    else
+        DeleteFile(tmpPath);
+}
+
+// Packed field order; bit i of BatteryTelemetry::present selects entry i.
+int BatteryTelemetry::* const telemetryFields[TELEMETRY_FIELDS] = {
+    &BatteryTelemetry::milliVolts, &BatteryTelemetry::milliAmps, &BatteryTelemetry::deciCelsius,
+    &BatteryTelemetry::cycleCount, &BatteryTelemetry::chargeMilliWattHours,
+    &BatteryTelemetry::fullMilliWattHours, &BatteryTelemetry::designMilliWattHours };
+
+int PackTelemetry(const BatteryTelemetry& tel, unsigned char* out) {
+    int n = 0;
+    out[n++] = (unsigned char)tel.present;
+    for (int i = 0; i < TELEMETRY_FIELDS; ++i) {
+        if (!(tel.present & (1 << i))) continue;
+        int v = tel.*telemetryFields[i];
+        unsigned int z = ((unsigned int)v << 1) ^ (unsigned int)(v >> 31);
+        for (; z >= 0x80; z >>= 7)
+            out[n++] = (unsigned char)(z | 0x80);
+        out[n++] = (unsigned char)z;
+    }
+    return n;
+}
+
+void StoreTelemetry(TelemetryRing& r, int slot, const BatteryTelemetry& tel) {
+    unsigned char record[TELEMETRY_RECORD_MAX];
+    int n = PackTelemetry(tel, record);
+    r.start[slot] = r.head + 1;
+    for (int i = 0; i < n; ++i)
+        r.pool[(r.head + i) % TELEMETRY_POOL] = record[i];
+    r.head += n;
+}
+
+void LoadTelemetry(const TelemetryRing& r, int slot, BatteryTelemetry* tel) {
+    memset(tel, 0, sizeof(BatteryTelemetry));
+    unsigned int at = r.start[slot];
+    if (at == 0 || r.head - (at - 1) > TELEMETRY_POOL)
+        return;
+    --at;
+    unsigned int present = r.pool[at++ % TELEMETRY_POOL];
+    for (int i = 0; i < TELEMETRY_FIELDS; ++i) {
+        if (!(present & (1 << i))) continue;
+        unsigned int z = 0;
+        for (int shift = 0; shift < 35 && at != r.head; shift += 7) {
+            unsigned char b = r.pool[at++ % TELEMETRY_POOL];
+            z |= (unsigned int)(b & 0x7F) << shift;
+            if (!(b & 0x80)) break;
+        }
+        tel->*telemetryFields[i] = (int)(z >> 1) ^ -(int)(z & 1);
+    }
+    tel->present = present;
+}
+
+void UpdateChargeCurve(ChargeCurve& c, const BatterySample& s) {
+    bool contiguous = c.lastT != 0 && s.t >= c.lastT && s.t - c.lastT <= CURVE_MAX_GAP;
+    c.lastT = s.t;
+    if (!s.ac || !contiguous || s.percent < c.stepPercent) {
+        // The moment this percent was reached is unknown, so the step is not timed.
+        c.stepPercent = s.percent;
+        c.stepT = 0;
+        return;
+    }
+    if (s.percent == c.stepPercent)
+        return;
+    if (c.stepT != 0) {
+        double minutes = difftime(s.t, c.stepT) / 60.0 / (s.percent - c.stepPercent);
+        for (int b = c.stepPercent; b < s.percent && b < CURVE_BUCKETS; ++b) {
+            if (c.observations[b] == 0)
+                c.minutesPerPercent[b] = (float)minutes;
+            else
+                c.minutesPerPercent[b] += (float)(0.3 * (minutes - c.minutesPerPercent[b]));
+            if (c.observations[b] < 0xFFFF) ++c.observations[b];
+        }
+    }
+    c.stepPercent = s.percent;
+    c.stepT = s.t;
+}
+
+// Seconds to reach 100% from a learned curve. Buckets not seen yet use the
+// slower of fallbackMinutes and the last learned bucket below them.
+int CurveTimeToFull(const ChargeCurve& c, int percent, double fallbackMinutes) {
+    double minutes = 0.0, previous = 0.0;
+    int learned = 0;
+    for (int b = (std::max)(percent, 0); b < CURVE_BUCKETS; ++b) {
+        if (c.observations[b]) {
+            previous = c.minutesPerPercent[b];
+            minutes += previous;
+            ++learned;
+        }
+        else {
+            double m = (std::max)(fallbackMinutes, previous);
+            if (m <= 0) return -1;
+            minutes += m;
+        }
+    }
+    if (learned == 0) return -1;
+    return (int)(minutes * 60.0 + 0.5);
+}
+
+int EstimateTimeToFull(int percent, double fallbackMinutes) {
+    if (!chargeCurveLoaded) {
+        BatteryDB db;
+        LoadBatteryDB(&db);
+        chargeCurve = db.curve;
+        chargeCurveLoaded = true;
+    }
+    return CurveTimeToFull(chargeCurve, percent, fallbackMinutes);
+}
+
+// --- Energy Ledger ---
+time_t LocalDayStart(time_t t) {
+    struct tm lt;
+    localtime_s(&lt, &t);
+    lt.tm_hour = lt.tm_min = lt.tm_sec = 0;
+    lt.tm_isdst = -1;
+    return mktime(&lt);
+}
+
+// Weeks start on Monday.
+time_t LocalWeekStart(time_t t) {
+    struct tm lt;
+    localtime_s(&lt, &t);
+    lt.tm_mday -= (lt.tm_wday + 6) % 7;
+    lt.tm_hour = lt.tm_min = lt.tm_sec = 0;
+    lt.tm_isdst = -1;
+    return mktime(&lt);
+}
+
+void AddEnergy(EnergyPeriod& p, double seconds, double p0, double p1) {
+    p.milliWattHours += (p0 + p1) / 2.0 * seconds / 3600.0;
+    p.seconds += seconds;
+}
+
+// Integrates [t0, t1] into a calendar rollup, splitting the trapezoid when the
+// interval crosses into a new period.
+void AddEnergyToPeriod(EnergyPeriod& cur, EnergyPeriod& last, time_t (*periodStart)(time_t),
+    time_t t0, time_t t1, double p0, double p1, bool gap) {
+    time_t start = periodStart(t1);
+    if (cur.start != start) {
+        if (cur.start != 0 && t0 < start && !gap) {
+            double pb = p0 + (p1 - p0) * difftime(start, t0) / difftime(t1, t0);
+            AddEnergy(cur, difftime(start, t0), p0, pb);
+            t0 = start;
+            p0 = pb;
+        }
+        if (cur.start != 0) last = cur;
+        memset(&cur, 0, sizeof(cur));
+        cur.start = start;
+        if (t0 < start) t0 = start;
+    }
+    if (t1 <= t0) return;
+    if (gap)
+        cur.gapSeconds += difftime(t1, t0);
+    else
+        AddEnergy(cur, difftime(t1, t0), p0, p1);
+}
+
+// Energy of the period containing now, or 0 if the rollup belongs to an earlier one.
+double CurrentPeriodWattHours(const EnergyPeriod& p, time_t (*periodStart)(time_t), time_t now) {
+    return p.start == periodStart(now) ? p.milliWattHours / 1000.0 : 0.0;
+}
+
+void UpdateEnergyLedger(EnergyLedger& e, const BatterySample& s) {
+    if (s.ac == 0 && (e.lastAc != 0 || e.session.start == 0)) {
+        // Unplugged, or first sample on battery: start a new session.
+        if (e.session.start != 0) e.lastSession = e.session;
+        memset(&e.session, 0, sizeof(e.session));
+        e.session.start = s.t;
+    }
+    else if (s.ac != 0 && e.lastAc == 0 && e.session.start != 0) {
+        e.lastSession = e.session;
+        memset(&e.session, 0, sizeof(e.session));
+    }
+
+    bool onBattery = s.ac == 0 && e.lastAc == 0 && e.lastT != 0 && s.t > e.lastT;
+    if (onBattery) {
+        // A missing power reading or a long silence is counted, not guessed.
+        bool gap = s.t - e.lastT > ENERGY_MAX_GAP || s.milliWatts <= 0 || e.lastMilliWatts <= 0;
+        double p0 = e.lastMilliWatts, p1 = s.milliWatts;
+        if (gap)
+            e.session.gapSeconds += difftime(s.t, e.lastT);
+        else
+            AddEnergy(e.session, difftime(s.t, e.lastT), p0, p1);
+        AddEnergyToPeriod(e.day, e.lastDay, LocalDayStart, e.lastT, s.t, p0, p1, gap);
+        AddEnergyToPeriod(e.week, e.lastWeek, LocalWeekStart, e.lastT, s.t, p0, p1, gap);
+    }
+    else {
+        AddEnergyToPeriod(e.day, e.lastDay, LocalDayStart, s.t, s.t, 0, 0, true);
+        AddEnergyToPeriod(e.week, e.lastWeek, LocalWeekStart, s.t, s.t, 0, 0, true);
+    }
+    e.lastMilliWatts = s.milliWatts;
+    e.lastAc = s.ac ? 1 : 0;
+    e.lastT = s.t;
+}
+
+// --- Usage Forecast ---
+#define USAGE_DECAY 0.9f
+#define USAGE_PLUG_PROBABILITY 0.5
+
+int HourOfWeek(time_t t) {
+    struct tm lt;
+    localtime_s(&lt, &t);
+    return lt.tm_wday * 24 + lt.tm_hour;
+}
+
+void UpdateUsageModel(UsageModel& m, const BatterySample& s) {
+    time_t week = LocalWeekStart(s.t);
+    if (m.weekStart == 0) {
+        m.weekStart = week;
+        m.weeks = 1.0f;
+    }
+    else if (week > m.weekStart) {
+        // Same as one weekly step per elapsed week: weeks the tool did not
+        // run count as observed weeks without plug-ins. The half day of slack
+        // absorbs DST shifts between the two week starts.
+        int elapsed = (int)((difftime(week, m.weekStart) + 12 * 3600) / (7 * 24 * 3600));
+        float decay = powf(USAGE_DECAY, (float)elapsed);
+        for (int h = 0; h < HOURS_PER_WEEK; ++h) {
+            m.plugIns[h] *= decay;
+            m.drawMilliWattSeconds[h] *= decay;
+            m.drawSeconds[h] *= decay;
+        }
+        m.weeks = m.weeks * decay + (1.0f - decay) / (1.0f - USAGE_DECAY);
+        m.weekStart = week;
+    }
+
+    int h = HourOfWeek(s.t);
+    if (s.ac && !m.lastAc && m.lastT)
+        m.plugIns[h] += 1.0f;
+    if (!s.ac && !m.lastAc && m.lastT && s.t > m.lastT && s.t - m.lastT <= ENERGY_MAX_GAP && s.milliWatts > 0) {
+        double dt = difftime(s.t, m.lastT);
+        m.drawMilliWattSeconds[h] += (float)(s.milliWatts * dt);
+        m.drawSeconds[h] += (float)dt;
+    }
+    m.lastAc = s.ac ? 1 : 0;
+    m.lastT = s.t;
+}
+
+struct UsageForecast {
+    time_t nextPlugIn;
+    double hoursUntil;
+    double milliWattHoursNeeded;   // 0 if no draw has been seen for those hours
+};
+
+// Scans at most one week of buckets ahead, so the cost is fixed.
+bool ForecastNextCharge(const UsageModel& m, time_t now, UsageForecast* out) {
+    if (m.weeks <= 0) return false;
+    struct tm lt;
+    localtime_s(&lt, &now);
+    double firstHourLeft = 1.0 - (lt.tm_min * 60 + lt.tm_sec) / 3600.0;
+    int h0 = lt.tm_wday * 24 + lt.tm_hour;
+
+    double hours = 0.0, needed = 0.0;
+    for (int i = 0; i < HOURS_PER_WEEK; ++i) {
+        int h = (h0 + i) % HOURS_PER_WEEK;
+        if (i > 0 && m.plugIns[h] / m.weeks >= USAGE_PLUG_PROBABILITY) {
+            out->hoursUntil = hours;
+            out->nextPlugIn = now + (time_t)(hours * 3600.0);
+            out->milliWattHoursNeeded = needed;
+            return true;
+        }
+        double span = i == 0 ? firstHourLeft : 1.0;
+        if (m.drawSeconds[h] > 0)
+            needed += m.drawMilliWattSeconds[h] / m.drawSeconds[h] * span;
+        hours += span;
+    }
+    return false;
+}
+
+// --- Wear Ledger ---
+#define WEAR_RECORD_INTERVAL (24 * 3600)
+
+void UpdateWearLedger(WearLedger& w, const BatterySample& s, const BatteryTelemetry& tel) {
+    if (tel.present & TELEMETRY_FULL) w.fullMilliWattHours = tel.fullMilliWattHours;
+    if (tel.present & TELEMETRY_DESIGN) w.designMilliWattHours = tel.designMilliWattHours;
+    if (w.fullMilliWattHours <= 0) return;
+
+    // Energy moved since the last sample; percent steps stand in when the
+    // driver reports no remaining capacity.
+    double moved = 0.0;
+    if ((tel.present & TELEMETRY_CHARGE) && w.lastChargeMilliWattHours > 0)
+        moved = fabs((double)(tel.chargeMilliWattHours - w.lastChargeMilliWattHours));
+    else if (!(tel.present & TELEMETRY_CHARGE) && w.lastPercent > 0)
+        moved = abs(s.percent - w.lastPercent) * w.fullMilliWattHours / 100.0;
+    // One cycle is a full discharge plus a full charge.
+    w.cycles += moved / (2.0 * w.fullMilliWattHours);
+    w.lastChargeMilliWattHours = (tel.present & TELEMETRY_CHARGE) ? tel.chargeMilliWattHours : 0;
+    w.lastPercent = s.percent;
+
+    if (w.firstT == 0) {
+        w.firstT = s.t;
+        w.firstCycles = w.cycles;
+    }
+    if (s.t - w.lastRecordT >= WEAR_RECORD_INTERVAL) {
+        double x = w.cycles, y = w.fullMilliWattHours;
+        w.n += 1;
+        w.sx += x;
+        w.sy += y;
+        w.sxx += x * x;
+        w.sxy += x * y;
+        w.lastRecordT = s.t;
+    }
+}
+
+// Date at which the fitted capacity reaches replaceAtPercent of design,
+// extrapolating the cycle rate seen so far. False without a downward trend.
+bool ProjectReplacement(const WearLedger& w, int replaceAtPercent, time_t now, time_t* outDate) {
+    if (w.n < 3 || w.designMilliWattHours <= 0) return false;
+    double denom = w.n * w.sxx - w.sx * w.sx;
+    if (denom <= 1e-9) return false;
+    double slope = (w.n * w.sxy - w.sx * w.sy) / denom;
+    if (slope >= 0) return false;
+    double intercept = (w.sy - slope * w.sx) / w.n;
+    double crossCycles = (w.designMilliWattHours * replaceAtPercent / 100.0 - intercept) / slope;
+    if (crossCycles <= w.cycles) {
+        *outDate = now;
+        return true;
+    }
+    double days = difftime(now, w.firstT) / 86400.0;
+    double perDay = days > 0 ? (w.cycles - w.firstCycles) / days : 0.0;
+    if (perDay <= 0) return false;
+    double daysLeft = (crossCycles - w.cycles) / perDay;
+    if (daysLeft > 50 * 365) return false;
+    *outDate = now + (time_t)(daysLeft * 86400.0);
+    return true;
+}
+
+// --- Alert Rules ---
+// Rules are read from [AlertN] sections of the INI and evaluated on every
+// logged sample. Each rule keeps its own running state, so a sample costs a
+// constant amount of work per rule.
+enum AlertMetric { METRIC_PERCENT, METRIC_MILLIWATTS, METRIC_TEMPERATURE, METRIC_COUNT };
+enum AlertType { ALERT_ABOVE, ALERT_BELOW, ALERT_RISE, ALERT_FALL, ALERT_ZSCORE };
+
+#define ALERT_BALLOON 1
+#define ALERT_LOG     2
+#define ALERT_HOOK    4
+
+struct AlertRule {
+    TCHAR name[64];
+    int metric;
+    int type;
+    double threshold;   // value, per-hour rate or z-score, depending on type
+    double clear;       // level that re-arms the rule after it fired
+    int window;         // smoothing span in samples for rates and z-scores
+    int actions;
+    TCHAR hook[MAX_PATH];  // command line; the rule name and value are appended
+
+    bool active;
+    int seen;
+    double prevValue;
+    time_t prevT;
+    double rate;
+    double mean;
+    double var;
+};
+
+std::vector<AlertRule> alertRules;
+bool alertRulesLoaded = false;
+
+const TCHAR* alertMetricNames[METRIC_COUNT] = { _T("percent"), _T("mw"), _T("temp") };
+const TCHAR* alertTypeNames[] = { _T("above"), _T("below"), _T("rise"), _T("fall"), _T("zscore") };
+
+int LookupAlertName(const TCHAR* value, const TCHAR* const* names, int count) {
+    for (int i = 0; i < count; ++i)
+        if (_tcsicmp(value, names[i]) == 0) return i;
+    return -1;
+}
+
+// Splits one "key=value" entry of a GetPrivateProfileSection buffer in place,
+// trimmed and unquoted the way GetPrivateProfileString would return it.
+bool SplitProfileEntry(TCHAR* entry, TCHAR** key, TCHAR** value) {
+    TCHAR* eq = _tcschr(entry, _T('='));
+    if (!eq) return false;
+    *eq = 0;
+    TCHAR* end = eq;
+    while (end > entry && _istspace(end[-1])) *--end = 0;
+    while (_istspace(*entry)) ++entry;
+    TCHAR* v = eq + 1;
+    while (_istspace(*v)) ++v;
+    size_t n = _tcslen(v);
+    while (n > 0 && _istspace(v[n - 1])) v[--n] = 0;
+    if (n >= 2 && (v[0] == _T('"') || v[0] == _T('\'')) && v[n - 1] == v[0]) {
+        v[n - 1] = 0;
+        ++v;
+    }
+    *key = entry;
+    *value = v;
+    return true;
+}
+
+bool SameAlertDefinition(const AlertRule& a, const AlertRule& b) {
+    return a.metric == b.metric && a.type == b.type && a.threshold == b.threshold && a.clear == b.clear &&
+        a.window == b.window && a.actions == b.actions &&
+        _tcscmp(a.name, b.name) == 0 && _tcscmp(a.hook, b.hook) == 0;
+}
+
+// Rules whose definition survived a reload keep their running state, so an
+// edit elsewhere in the INI neither re-fires an active rule nor resets the
+// averages behind rates and z-scores. Matches are searched from just after the
+// previous one, which finds them at once when rules were inserted or removed.
+void CarryAlertState(std::vector<AlertRule>& rules, const std::vector<AlertRule>& old) {
+    std::vector<bool> used(old.size(), false);
+    size_t next = 0;
+    for (AlertRule& r : rules) {
+        for (size_t k = 0; k < old.size(); ++k) {
+            size_t j = (next + k) % old.size();
+            if (!used[j] && SameAlertDefinition(r, old[j])) {
+                r = old[j];
+                used[j] = true;
+                next = j + 1;
+                break;
+            }
+        }
+    }
+}
+
+void LoadAlertRules() {
+    std::vector<AlertRule> rules;
+    alertRulesLoaded = true;
+    GetIniPath();
+    int count = GetPrivateProfileInt(_T("Alerts"), _T("Count"), -1, iniPath);
+    if (count < 0) {
+        // No [Alerts] section: keep the built-in low battery warning.
+        AlertRule r = { 0 };
+        StringCchCopy(r.name, _countof(r.name), _T("Low battery"));
+        r.metric = METRIC_PERCENT;
+        r.type = ALERT_BELOW;
+        r.threshold = 10;
+        r.clear = 12;
+        r.window = 1;
+        r.actions = ALERT_BALLOON;
+        rules.push_back(r);
     }
     else {
-        db.idxDischarge = db.idxCharge = 0;
-        memset(db.discharge, 0, sizeof(db.discharge));
-        memset(db.charge, 0, sizeof(db.charge));
+        rules.reserve(count);
+    }
+    // One read per section; every GetPrivateProfile* call parses the whole file.
+    TCHAR entries[4096];
+    for (int i = 1; i <= count; ++i) {
+        TCHAR section[32], metric[32] = _T("percent"), type[32] = _T("below"), actions[64] = _T("balloon");
+        StringCchPrintf(section, _countof(section), _T("Alert%d"), i);
+        AlertRule r = { 0 };
+        StringCchCopy(r.name, _countof(r.name), section);
+        r.window = 20;
+        bool haveClear = false;
+        GetPrivateProfileSection(section, entries, _countof(entries), iniPath);
+        for (TCHAR* p = entries; *p; ) {
+            TCHAR* next = p + _tcslen(p) + 1;
+            TCHAR *key, *value;
+            if (SplitProfileEntry(p, &key, &value)) {
+                if (_tcsicmp(key, _T("Name")) == 0) StringCchCopy(r.name, _countof(r.name), value);
+                else if (_tcsicmp(key, _T("Metric")) == 0) StringCchCopy(metric, _countof(metric), value);
+                else if (_tcsicmp(key, _T("Type")) == 0) StringCchCopy(type, _countof(type), value);
+                else if (_tcsicmp(key, _T("Threshold")) == 0) r.threshold = _tstof(value);
+                else if (_tcsicmp(key, _T("Clear")) == 0) { r.clear = _tstof(value); haveClear = true; }
+                else if (_tcsicmp(key, _T("Window")) == 0) r.window = _tstoi(value);
+                else if (_tcsicmp(key, _T("Actions")) == 0) StringCchCopy(actions, _countof(actions), value);
+                else if (_tcsicmp(key, _T("Hook")) == 0) StringCchCopy(r.hook, _countof(r.hook), value);
+            }
+            p = next;
+        }
+        r.metric = LookupAlertName(metric, alertMetricNames, METRIC_COUNT);
+        r.type = LookupAlertName(type, alertTypeNames, _countof(alertTypeNames));
+        if (r.metric < 0 || r.type < 0) continue;
+        if (!haveClear) r.clear = r.threshold;
+        r.window = (std::max)(1, r.window);
+        if (_tcsstr(actions, _T("balloon"))) r.actions |= ALERT_BALLOON;
+        if (_tcsstr(actions, _T("log"))) r.actions |= ALERT_LOG;
+        if (_tcsstr(actions, _T("hook"))) r.actions |= ALERT_HOOK;
+        rules.push_back(r);
+    }
+    CarryAlertState(rules, alertRules);
+    alertRules.swap(rules);
+}
+
+void FireAlert(const AlertRule& r, double value) {
+    TCHAR msg[128];
+    StringCchPrintf(msg, _countof(msg), _T("%s (%s = %.1f)"), r.name, alertMetricNames[r.metric], value);
+    if (r.actions & ALERT_BALLOON) {
+        nid.uFlags = NIF_INFO;
+        nid.dwInfoFlags = NIIF_WARNING;
+        StringCchCopy(nid.szInfoTitle, _countof(nid.szInfoTitle), _T("Battery Status"));
+        StringCchCopy(nid.szInfo, _countof(nid.szInfo), msg);
+        Shell_NotifyIcon(NIM_MODIFY, &nid);
+    }
+    if (r.actions & ALERT_LOG) {
+        GetLogPath();
+        FILE* f;
+        _tfopen_s(&f, logPath, _T("a"));
+        if (f) {
+            SYSTEMTIME st;
+            GetLocalTime(&st);
+            _ftprintf(f, _T("%04d-%02d-%02d %02d:%02d:%02d %s\n"),
+                st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, msg);
+            fclose(f);
+        }
+    }
+    if ((r.actions & ALERT_HOOK) && r.hook[0]) {
+        TCHAR cmd[MAX_PATH + 128];
+        StringCchPrintf(cmd, _countof(cmd), _T("%s \"%s\" %.1f"), r.hook, r.name, value);
+        STARTUPINFO si = { sizeof(si) };
+        PROCESS_INFORMATION pi;
+        if (CreateProcess(NULL, cmd, NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi)) {
+            CloseHandle(pi.hThread);
+            CloseHandle(pi.hProcess);
+        }
+    }
+}
+
+// Updates one rule with the latest value and returns the level to compare
+// against its threshold, or NAN while the rule has too little data.
+double UpdateAlertState(AlertRule& r, double value, time_t t) {
+    double alpha = 2.0 / (r.window + 1);
+    double level = NAN;
+    switch (r.type) {
+    case ALERT_ABOVE:
+    case ALERT_BELOW:
+        level = value;
+        break;
+    case ALERT_RISE:
+    case ALERT_FALL:
+        if (r.seen > 0 && t > r.prevT) {
+            double perHour = (value - r.prevValue) * 3600.0 / difftime(t, r.prevT);
+            r.rate = r.seen == 1 ? perHour : r.rate + alpha * (perHour - r.rate);
+            if (r.seen >= r.window) level = r.rate;
+        }
+        break;
+    case ALERT_ZSCORE: {
+        if (r.seen >= r.window && r.var > 0)
+            level = fabs(value - r.mean) / sqrt(r.var);
+        double delta = value - r.mean;
+        r.mean = r.seen == 0 ? value : r.mean + alpha * delta;
+        r.var = r.seen == 0 ? 0.0 : (1.0 - alpha) * (r.var + alpha * delta * delta);
+        break;
+    }
+    }
+    r.prevValue = value;
+    r.prevT = t;
+    ++r.seen;
+    return level;
+}
+
+void EvaluateAlertRules(const BatterySample& s, double temperature) {
+    if (!alertRulesLoaded)
+        LoadAlertRules();
+    double values[METRIC_COUNT] = { (double)s.percent, (double)s.milliWatts, temperature };
+    for (AlertRule& r : alertRules) {
+        double value = values[r.metric];
+        if (value != value) continue;
+        double level = UpdateAlertState(r, value, s.t);
+        if (level != level) continue;
+        // Everything is compared as "x >= threshold"; falls use a positive magnitude.
+        bool below = r.type == ALERT_BELOW;
+        double x = (below || r.type == ALERT_FALL) ? -level : level;
+        double threshold = below ? -r.threshold : r.threshold;
+        double clear = (std::min)(below ? -r.clear : r.clear, threshold);
+        if (!r.active && x >= threshold) {
+            r.active = true;
+            FireAlert(r, value);
+        }
+        else if (r.active && x < clear) {
+            r.active = false;
+        }
+    }
+}
+
+// --- Configuration ---
+// BatteryStatus.ini is parsed once into config and served from memory. Writes
+// are debounced and applied to a temp copy that replaces the file in one
+// rename; a watcher thread picks up edits made while the tool is running.
+#define CONFIG_SAVE_DELAY 2000
+
+struct BatteryConfig {
+    int toolbarX;
+    int toolbarY;
+    bool toolbarVisible;
+    int sampleIntervalMs;   // [Sampling] Interval
+    int maxSampleAgeHours;  // [History] MaxAgeHours, 0 keeps every sample
+    int replaceAtPercent;   // [Wear] ReplaceAtPercent of design capacity
+};
+
+BatteryConfig config = { 100, 100, true, 3000, 0, 80 };
+bool configLoaded = false;
+#define CONFIG_DIRTY_POSITION 1
+#define CONFIG_DIRTY_VISIBLE  2
+int configDirty = 0;    // CONFIG_DIRTY_* keys changed in memory, not yet written
+FILETIME configFileTime = { 0 };
+
+bool GetIniFileTime(FILETIME* ft) {
+    GetIniPath();
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesEx(iniPath, GetFileExInfoStandard, &data)) {
+        ft->dwLowDateTime = ft->dwHighDateTime = 0;
+        return false;
+    }
+    *ft = data.ftLastWriteTime;
+    return true;
+}
+
+void LoadConfig() {
+    GetIniPath();
+    TCHAR posbuf[64];
+    GetPrivateProfileString(_T("Toolbar"), _T("Position"), _T("100,100"), posbuf, 64, iniPath);
+    config.toolbarX = 100;
+    config.toolbarY = 100;
+    _stscanf_s(posbuf, _T("%d,%d"), &config.toolbarX, &config.toolbarY);
+    config.toolbarVisible = GetPrivateProfileInt(_T("Toolbar"), _T("Visible"), 1, iniPath) != 0;
+    config.sampleIntervalMs = (std::max)(500, (int)GetPrivateProfileInt(_T("Sampling"), _T("Interval"), 3000, iniPath));
+    config.maxSampleAgeHours = (std::max)(0, (int)GetPrivateProfileInt(_T("History"), _T("MaxAgeHours"), 0, iniPath));
+    config.replaceAtPercent = (std::max)(1, (std::min)(99, (int)GetPrivateProfileInt(_T("Wear"), _T("ReplaceAtPercent"), 80, iniPath)));
+    LoadAlertRules();
+    GetIniFileTime(&configFileTime);
+    configLoaded = true;
+}
+
+const BatteryConfig& GetConfig() {
+    if (!configLoaded)
+        LoadConfig();
+    return config;
+}
+
+void FlushConfig() {
+    if (hMainWnd) KillTimer(hMainWnd, IDT_CONFIG_SAVE);
+    if (!configDirty) return;
+    int dirty = configDirty;
+    configDirty = 0;
+
+    GetIniPath();
+    TCHAR tmpPath[MAX_PATH];
+    StringCchPrintf(tmpPath, MAX_PATH, _T("%s.tmp"), iniPath);
+    if (!CopyFile(iniPath, tmpPath, FALSE))
+        DeleteFile(tmpPath);
+    if (dirty & CONFIG_DIRTY_POSITION) {
+        TCHAR posbuf[64];
+        StringCchPrintf(posbuf, 64, _T("%d,%d"), config.toolbarX, config.toolbarY);
+        WritePrivateProfileString(_T("Toolbar"), _T("Position"), posbuf, tmpPath);
+    }
+    if (dirty & CONFIG_DIRTY_VISIBLE)
+        WritePrivateProfileString(_T("Toolbar"), _T("Visible"), config.toolbarVisible ? _T("1") : _T("0"), tmpPath);
+    WritePrivateProfileString(NULL, NULL, NULL, tmpPath);
+    if (MoveFileEx(tmpPath, iniPath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+        GetIniFileTime(&configFileTime);
+}
+
+void MarkConfigDirty(int keys) {
+    configDirty |= keys;
+    if (hMainWnd)
+        SetTimer(hMainWnd, IDT_CONFIG_SAVE, CONFIG_SAVE_DELAY, NULL);
+    else
+        FlushConfig();
+}
+
+// Returns true if the INI changed on disk since it was last loaded or written.
+// Toolbar changes still waiting for FlushConfig are newer than the file and
+// win over it; they are written out as scheduled.
+bool ReloadConfigIfChanged() {
+    FILETIME ft;
+    GetIniFileTime(&ft);
+    if (CompareFileTime(&ft, &configFileTime) == 0)
+        return false;
+    BatteryConfig pending = config;
+    LoadConfig();
+    if (configDirty & CONFIG_DIRTY_POSITION) {
+        config.toolbarX = pending.toolbarX;
+        config.toolbarY = pending.toolbarY;
+    }
+    if (configDirty & CONFIG_DIRTY_VISIBLE)
+        config.toolbarVisible = pending.toolbarVisible;
+    return true;
+}
+
+// True if a change record names the INI. History.bin, the checkpoint and the
+// log live in the same directory and change every few seconds.
+bool IsIniChange(const FILE_NOTIFY_INFORMATION* fni, const WCHAR* iniName) {
+    return CompareStringOrdinal(fni->FileName, fni->FileNameLength / sizeof(WCHAR), iniName, -1, TRUE) == CSTR_EQUAL;
+}
+
+DWORD WINAPI ConfigWatchThread(LPVOID param) {
+    HWND hwnd = (HWND)param;
+    GetIniPath();
+    TCHAR dir[MAX_PATH];
+    StringCchCopy(dir, MAX_PATH, iniPath);
+    TCHAR* p = _tcsrchr(dir, _T('\\'));
+    if (!p) return 0;
+    *p = 0;
+    WCHAR iniName[MAX_PATH];
+#ifdef UNICODE
+    StringCchCopyW(iniName, MAX_PATH, p + 1);
+#else
+    MultiByteToWideChar(CP_ACP, 0, p + 1, -1, iniName, MAX_PATH);
+#endif
+    HANDLE hDir = CreateFile(dir, FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (hDir == INVALID_HANDLE_VALUE) return 0;
+    DWORD buf[1024];  // change records must be DWORD aligned
+    DWORD bytes = 0;
+    while (ReadDirectoryChangesW(hDir, buf, sizeof(buf), FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME, &bytes, NULL, NULL)) {
+        // Zero bytes means the records overflowed the buffer; check the INI anyway.
+        bool changed = bytes == 0;
+        const FILE_NOTIFY_INFORMATION* fni = (const FILE_NOTIFY_INFORMATION*)buf;
+        while (bytes && !changed) {
+            changed = IsIniChange(fni, iniName);
+            if (!fni->NextEntryOffset) break;
+            fni = (const FILE_NOTIFY_INFORMATION*)((const BYTE*)fni + fni->NextEntryOffset);
+        }
+        if (changed)
+            PostMessage(hwnd, WM_CONFIGCHANGED, 0, 0);
+    }
+    CloseHandle(hDir);
+    return 0;
+}
+
+void StartConfigWatch(HWND hwnd) {
+    HANDLE hThread = CreateThread(NULL, 0, ConfigWatchThread, hwnd, 0, NULL);
+    if (hThread) CloseHandle(hThread);
+}
+
+// --- Sample Filter ---
+// Sits between acquisition and History.bin. A rolling median over the last
+// FILTER_WINDOW raw readings drops one-tick percent jumps and repairs missing
+// or spiking power readings; genuine steps win the median after a few ticks.
+#define FILTER_WINDOW 5
+#define FILTER_PERCENT_PER_MIN 3.0
+#define FILTER_SPIKE_FACTOR 4
+
+struct SampleFilter {
+    int percents[FILTER_WINDOW];
+    int milliWatts[FILTER_WINDOW];
+    int count;
+    int next;
+    int lastAc;
+    int lastPercent;
+    time_t lastT;
+    unsigned int rejected;
+    unsigned int repaired;
+};
+
+SampleFilter sampleFilter = { 0 };
+
+int MedianOfWindow(const int* values, int count) {
+    int tmp[FILTER_WINDOW];
+    memcpy(tmp, values, count * sizeof(int));
+    std::nth_element(tmp, tmp + count / 2, tmp + count);
+    return tmp[count / 2];
+}
+
+// Returns false if the sample should be dropped; may repair s in place.
+bool FilterBatterySample(SampleFilter& f, BatterySample& s) {
+    if (f.count > 0 && s.ac != f.lastAc) {
+        // Plugging in or out changes the regime; start over.
+        f.count = f.next = 0;
+        f.lastT = 0;
+    }
+    f.lastAc = s.ac;
+    f.percents[f.next] = s.percent;
+    f.milliWatts[f.next] = s.milliWatts;
+    f.next = (f.next + 1) % FILTER_WINDOW;
+    if (f.count < FILTER_WINDOW) ++f.count;
+
+    if (f.count >= 3) {
+        int medPercent = MedianOfWindow(f.percents, f.count);
+        double minutes = f.lastT ? difftime(s.t, f.lastT) / 60.0 : 0.0;
+        double limit = 1.0 + FILTER_PERCENT_PER_MIN * (std::max)(minutes, 0.0);
+        bool jumped = f.lastT && fabs((double)(s.percent - f.lastPercent)) > limit;
+        if (jumped && abs(s.percent - medPercent) > 1) {
+            ++f.rejected;
+            return false;
+        }
+
+        int medWatts = MedianOfWindow(f.milliWatts, f.count);
+        if (medWatts > 0 && (s.milliWatts <= 0 || s.milliWatts > FILTER_SPIKE_FACTOR * medWatts)) {
+            s.milliWatts = medWatts;
+            s.rate = medWatts / 1000;
+            ++f.repaired;
+        }
     }
+    f.lastPercent = s.percent;
+    f.lastT = s.t;
+    return true;
+}
+
+// outSample, if given, receives what to show and estimate from: the filtered
+// sample, or the last accepted percent when this one was dropped as a glitch.
+// It is left alone for readings that fail validation.
+void LogBatterySample(int percent, int ac, int rate, int milliWatts, int systemFlag, const BatteryTelemetry* telemetry, BatterySample* outSample) {
+    if (!IsBatterySampleValid(percent, ac, rate, milliWatts, systemFlag))
+        return;
     BatterySample s;
     s.percent = percent;
     s.ac = ac;
@@ -100,53 +1044,407 @@ void LogBatterySample(int percent, int ac, int rate, int milliWatts, int systemF
     s.flag = systemFlag;
     s.milliWatts = milliWatts;
     s.t = time(NULL);
+    if (!FilterBatterySample(sampleFilter, s)) {
+        s.percent = sampleFilter.lastPercent;
+        if (outSample) *outSample = s;
+        return;
+    }
+    if (outSample) *outSample = s;
+    BatteryTelemetry tel = { 0 };
+    if (telemetry) tel = *telemetry;
+    BatteryDB db;
+    LoadBatteryDB(&db);
 
     if (ac == 0) {
         db.discharge[db.idxDischarge] = s;
+        StoreTelemetry(db.dischargeTelemetry, db.idxDischarge, tel);
         db.idxDischarge = (db.idxDischarge + 1) % MAX_SAMPLES;
     }
     else {
         db.charge[db.idxCharge] = s;
+        StoreTelemetry(db.chargeTelemetry, db.idxCharge, tel);
         db.idxCharge = (db.idxCharge + 1) % MAX_SAMPLES;
     }
-    _tfopen_s(&f, dbPath, _T("w+b"));
-    if (f) {
-        fwrite(&db, sizeof(BatteryDB), 1, f);
-        fclose(f);
+    UpdateChargeCurve(db.curve, s);
+    UpdateEnergyLedger(db.energy, s);
+    UpdateUsageModel(db.usage, s);
+    UpdateWearLedger(db.wear, s, tel);
+    chargeCurve = db.curve;
+    chargeCurveLoaded = true;
+    SaveBatteryDB(&db);
+    EvaluateAlertRules(s, (tel.present & TELEMETRY_TEMP) ? tel.deciCelsius / 10.0 : NAN);
+
+    dischargeSampleCount = chargeSampleCount = 0;
+    for (int i = 0; i < MAX_SAMPLES; ++i) {
+        if (db.discharge[i].t) ++dischargeSampleCount;
+        if (db.charge[i].t) ++chargeSampleCount;
     }
 }
 
-int ReadBatteryHistory(int ac, BatterySample* outSamples, int maxSamples) {
-    GetDbPath();
-    FILE* f;
-    _tfopen_s(&f, dbPath, _T("rb"));
-    if (!f) return 0;
+// Copies one ring in time order. outTelemetry may be NULL; when given it
+// receives the telemetry recorded with each returned sample.
+int ReadBatteryHistory(int ac, BatterySample* outSamples, int maxSamples, BatteryTelemetry* outTelemetry = NULL) {
     BatteryDB db;
-    size_t n = fread(&db, sizeof(BatteryDB), 1, f);
-    fclose(f);
-    if (n != 1) return 0;
+    if (!LoadBatteryDB(&db)) return 0;
+
+    const BatterySample* ring = ac == 0 ? db.discharge : db.charge;
+    const TelemetryRing& telemetry = ac == 0 ? db.dischargeTelemetry : db.chargeTelemetry;
+    int idx = ac == 0 ? db.idxDischarge : db.idxCharge;
 
+    int maxAgeHours = GetConfig().maxSampleAgeHours;
+    time_t oldest = maxAgeHours > 0 ? time(NULL) - (time_t)maxAgeHours * 3600 : 1;
+    int order[MAX_SAMPLES];
     int found = 0;
-    if (ac == 0) {
-        for (int i = 0; i < MAX_SAMPLES; ++i) {
-            int pos = (db.idxDischarge + i) % MAX_SAMPLES;
-            if (db.discharge[pos].t == 0) continue;
-            if (found < maxSamples)
-                outSamples[found++] = db.discharge[pos];
+    for (int i = 0; i < MAX_SAMPLES; ++i) {
+        int pos = (idx + i) % MAX_SAMPLES;
+        if (ring[pos].t < oldest) continue;
+        if (found < maxSamples)
+            order[found++] = pos;
+    }
+    std::sort(order, order + found, [ring](int a, int b) {
+        return ring[a].t < ring[b].t;
+        });
+    for (int i = 0; i < found; ++i) {
+        outSamples[i] = ring[order[i]];
+        if (outTelemetry) LoadTelemetry(telemetry, order[i], &outTelemetry[i]);
+    }
+    return found;
+}
+
+// --- Regression Kernels ---
+// Slope fits over contiguous time (hours) and value columns. Each kernel has a
+// scalar version and an AVX version; the table is picked once at first use.
+#define MIN_FIT_HOURS 0.017
+
+struct RegressionKernels {
+    // Weighted least squares slope of y over t; w may be NULL for unit weights.
+    double (*WeightedSlope)(const double* t, const double* y, const double* w, int n);
+    // Slopes for all pairs (i < j), NaN where t[j] - t[i] < MIN_FIT_HOURS.
+    // out must hold n * (n - 1) / 2 values.
+    void (*PairwiseSlopes)(const double* t, const double* y, int n, double* out);
+    // Unweighted slopes over the last windows[k] samples, windows ascending.
+    void (*MultiWindowSlopes)(const double* t, const double* y, int n, const int* windows, int count, double* out);
+};
+
+struct FitSums {
+    double s, st, sy, stt, sty;
+};
+
+double SlopeFromSums(const FitSums& f) {
+    double denom = f.s * f.stt - f.st * f.st;
+    if (fabs(denom) < 1e-12) return 0.0;
+    return (f.s * f.sty - f.st * f.sy) / denom;
+}
+
+void AccumulateSumsScalar(const double* t, const double* y, const double* w, int n, FitSums& f) {
+    for (int i = 0; i < n; ++i) {
+        double wi = w ? w[i] : 1.0;
+        f.s += wi;
+        f.st += wi * t[i];
+        f.sy += wi * y[i];
+        f.stt += wi * t[i] * t[i];
+        f.sty += wi * t[i] * y[i];
+    }
+}
+
+double WeightedSlopeScalar(const double* t, const double* y, const double* w, int n) {
+    FitSums f = { 0 };
+    AccumulateSumsScalar(t, y, w, n, f);
+    return SlopeFromSums(f);
+}
+
+void PairwiseSlopesScalar(const double* t, const double* y, int n, double* out) {
+    int k = 0;
+    for (int i = 0; i < n; ++i) {
+        for (int j = i + 1; j < n; ++j) {
+            double dt = t[j] - t[i];
+            out[k++] = dt >= MIN_FIT_HOURS ? (y[j] - y[i]) / dt : NAN;
         }
     }
-    else {
-        for (int i = 0; i < MAX_SAMPLES; ++i) {
-            int pos = (db.idxCharge + i) % MAX_SAMPLES;
-            if (db.charge[pos].t == 0) continue;
-            if (found < maxSamples)
-                outSamples[found++] = db.charge[pos];
+}
+
+void MultiWindowSlopesScalar(const double* t, const double* y, int n, const int* windows, int count, double* out) {
+    FitSums f = { 0 };
+    int done = 0;
+    for (int k = 0; k < count; ++k) {
+        int len = (std::min)(windows[k], n);
+        if (len > done) {
+            AccumulateSumsScalar(t + n - len, y + n - len, NULL, len - done, f);
+            done = len;
         }
+        out[k] = SlopeFromSums(f);
+    }
+}
+
+#if defined(_M_X64) || defined(_M_IX86)
+double HorizontalSum(__m256d v) {
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+void AccumulateSumsAvx(const double* t, const double* y, const double* w, int n, FitSums& f) {
+    __m256d s = _mm256_setzero_pd(), st = s, sy = s, stt = s, sty = s;
+    __m256d one = _mm256_set1_pd(1.0);
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d vt = _mm256_loadu_pd(t + i);
+        __m256d vy = _mm256_loadu_pd(y + i);
+        __m256d vw = w ? _mm256_loadu_pd(w + i) : one;
+        __m256d wt = _mm256_mul_pd(vw, vt);
+        s = _mm256_add_pd(s, vw);
+        st = _mm256_add_pd(st, wt);
+        sy = _mm256_add_pd(sy, _mm256_mul_pd(vw, vy));
+        stt = _mm256_add_pd(stt, _mm256_mul_pd(wt, vt));
+        sty = _mm256_add_pd(sty, _mm256_mul_pd(wt, vy));
+    }
+    f.s += HorizontalSum(s);
+    f.st += HorizontalSum(st);
+    f.sy += HorizontalSum(sy);
+    f.stt += HorizontalSum(stt);
+    f.sty += HorizontalSum(sty);
+    AccumulateSumsScalar(t + i, y + i, w ? w + i : NULL, n - i, f);
+}
+
+double WeightedSlopeAvx(const double* t, const double* y, const double* w, int n) {
+    FitSums f = { 0 };
+    AccumulateSumsAvx(t, y, w, n, f);
+    return SlopeFromSums(f);
+}
+
+void PairwiseSlopesAvx(const double* t, const double* y, int n, double* out) {
+    __m256d minDt = _mm256_set1_pd(MIN_FIT_HOURS);
+    __m256d nan = _mm256_set1_pd(NAN);
+    int k = 0;
+    for (int i = 0; i < n; ++i) {
+        __m256d ti = _mm256_set1_pd(t[i]);
+        __m256d yi = _mm256_set1_pd(y[i]);
+        int j = i + 1;
+        for (; j + 4 <= n; j += 4, k += 4) {
+            __m256d dt = _mm256_sub_pd(_mm256_loadu_pd(t + j), ti);
+            __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(y + j), yi);
+            __m256d ok = _mm256_cmp_pd(dt, minDt, _CMP_GE_OQ);
+            _mm256_storeu_pd(out + k, _mm256_blendv_pd(nan, _mm256_div_pd(dy, dt), ok));
+        }
+        for (; j < n; ++j) {
+            double dt = t[j] - t[i];
+            out[k++] = dt >= MIN_FIT_HOURS ? (y[j] - y[i]) / dt : NAN;
+        }
+    }
+}
+
+void MultiWindowSlopesAvx(const double* t, const double* y, int n, const int* windows, int count, double* out) {
+    FitSums f = { 0 };
+    int done = 0;
+    for (int k = 0; k < count; ++k) {
+        int len = (std::min)(windows[k], n);
+        if (len > done) {
+            AccumulateSumsAvx(t + n - len, y + n - len, NULL, len - done, f);
+            done = len;
+        }
+        out[k] = SlopeFromSums(f);
+    }
+}
+
+// The kernels use AVX only (no AVX2 or FMA), so that is all the CPU and OS need.
+bool CpuHasAvx() {
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    return osxsave && avx && (_xgetbv(0) & 6) == 6;
+}
+#endif
+
+const RegressionKernels scalarKernels = { WeightedSlopeScalar, PairwiseSlopesScalar, MultiWindowSlopesScalar };
+#if defined(_M_X64) || defined(_M_IX86)
+const RegressionKernels avxKernels = { WeightedSlopeAvx, PairwiseSlopesAvx, MultiWindowSlopesAvx };
+#endif
+
+const RegressionKernels& GetRegressionKernels() {
+#if defined(_M_X64) || defined(_M_IX86)
+    static const RegressionKernels* selected = CpuHasAvx() ? &avxKernels : &scalarKernels;
+    return *selected;
+#else
+    return scalarKernels;
+#endif
+}
+
+// Theil-Sen slope: median of all pairwise slopes. scratch must hold n * (n - 1) / 2 values.
+double TheilSenSlope(const double* t, const double* y, int n, double* scratch) {
+    if (n < 2) return 0.0;
+    GetRegressionKernels().PairwiseSlopes(t, y, n, scratch);
+    double* end = std::remove_if(scratch, scratch + n * (n - 1) / 2, [](double v) { return v != v; });
+    int m = (int)(end - scratch);
+    if (m == 0) return 0.0;
+    std::nth_element(scratch, scratch + m / 2, end);
+    double median = scratch[m / 2];
+    if (m % 2 == 0) {
+        double lower = *std::max_element(scratch, scratch + m / 2);
+        median = (median + lower) / 2.0;
+    }
+    return median;
+}
+
+// Splits samples into an hours-since-first time column and a percent column.
+void SamplesToColumns(const BatterySample* samples, int n, double* t, double* y) {
+    for (int i = 0; i < n; ++i) {
+        t[i] = difftime(samples[i].t, samples[0].t) / 3600.0;
+        y[i] = samples[i].percent;
+    }
+}
+
+// Fits %/hour over samples ordered by time. False when the history shows no change.
+bool FitHistoryRate(const BatterySample* samples, int n, double* outRate) {
+    double t[MAX_SAMPLES], y[MAX_SAMPLES], w[MAX_SAMPLES];
+    double scratch[MAX_SAMPLES * (MAX_SAMPLES - 1) / 2];
+    SamplesToColumns(samples, n, t, y);
+    double span = t[n - 1] - t[0];
+
+    // Robust slope first; a recency-weighted fit covers histories where most
+    // pairs sit on the same percent step and the median slope is zero.
+    double rate = 0.0;
+    if (span >= MIN_FIT_HOURS) {
+        rate = TheilSenSlope(t, y, n, scratch);
+        if (rate == 0.0 && y[n - 1] != y[0]) {
+            for (int i = 0; i < n; ++i)
+                w[i] = 1.0 + (double)i / n;
+            rate = GetRegressionKernels().WeightedSlope(t, y, w, n);
+        }
+    }
+
+    if (rate == 0.0) {
+        double totalPercent = 0.0;
+        double totalTime = 0.0;
+        int validIntervals = 0;
+        for (int i = 1; i < n; ++i) {
+            double dPercent = samples[i].percent - samples[i - 1].percent;
+            double dTime = difftime(samples[i].t, samples[i - 1].t) / 3600.0;
+            if (fabs(dTime) < MIN_FIT_HOURS || dPercent == 0) continue;
+            totalPercent += dPercent;
+            totalTime += dTime;
+            ++validIntervals;
+        }
+        if (validIntervals == 0) {
+            totalPercent = y[n - 1] - y[0];
+            totalTime = span;
+        }
+        if (fabs(totalTime) < MIN_FIT_HOURS || totalPercent == 0) return false;
+        rate = totalPercent / totalTime;
+    }
+    *outRate = rate;
+    return true;
+}
+
+// --- Estimator Checkpoint ---
+// Estimator state that would otherwise be rebuilt from History.bin after a
+// restart. Saved on exit, at logoff and every CHECKPOINT_INTERVAL, restored in
+// WM_CREATE, so the first paint has an estimate before two new samples exist.
+// The charge curve is not included: History.bin always holds its newest copy.
+#define CHECKPOINT_MAGIC    0x50434253
+#define CHECKPOINT_VERSION  2
+#define CHECKPOINT_INTERVAL (5 * 60 * 1000)
+#define CHECKPOINT_MAX_AGE  (6 * 3600)
+#define CHECKPOINT_FILTER_INTERVALS 3   // filter window survives only a quick restart
+
+struct EstimatorCheckpoint {
+    DWORD magic;
+    DWORD version;
+    DWORD size;
+    time_t saved;
+    double ratePerHour[2];      // last fitted rate, indexed by AC state
+    time_t rateT[2];            // when it was fitted, 0 if never
+    int sampleCounts[2];
+    SampleFilter filter;        // includes the last accepted sample
+    DWORD checksum;             // CRC-32 of all preceding bytes
+};
+
+TCHAR checkpointPath[MAX_PATH] = { 0 };
+double estimatorRate[2] = { 0, 0 };
+time_t estimatorRateT[2] = { 0, 0 };
+
+void GetCheckpointPath() {
+    if (!checkpointPath[0]) {
+        GetModuleFileName(NULL, checkpointPath, MAX_PATH);
+        TCHAR* p = _tcsrchr(checkpointPath, _T('\\'));
+        if (p) *(p + 1) = 0;
+        _tcscat_s(checkpointPath, MAX_PATH, _T("Estimator.ckpt"));
     }
-    std::sort(outSamples, outSamples + found, [](const BatterySample& a, const BatterySample& b) {
-        return a.t < b.t;
-        });
-    return found;
+}
+
+DWORD Crc32(const void* data, size_t len) {
+    const BYTE* p = (const BYTE*)data;
+    DWORD crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < len; ++i) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; ++k)
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
+
+void SaveCheckpoint() {
+    EstimatorCheckpoint cp;
+    memset(&cp, 0, sizeof(cp));
+    cp.magic = CHECKPOINT_MAGIC;
+    cp.version = CHECKPOINT_VERSION;
+    cp.size = sizeof(cp);
+    cp.saved = time(NULL);
+    for (int ac = 0; ac < 2; ++ac) {
+        cp.ratePerHour[ac] = estimatorRate[ac];
+        cp.rateT[ac] = estimatorRateT[ac];
+    }
+    cp.sampleCounts[0] = dischargeSampleCount;
+    cp.sampleCounts[1] = chargeSampleCount;
+    cp.filter = sampleFilter;
+    cp.checksum = Crc32(&cp, offsetof(EstimatorCheckpoint, checksum));
+
+    GetCheckpointPath();
+    TCHAR tmpPath[MAX_PATH];
+    StringCchPrintf(tmpPath, MAX_PATH, _T("%s.tmp"), checkpointPath);
+    FILE* f;
+    _tfopen_s(&f, tmpPath, _T("wb"));
+    if (!f) return;
+    size_t written = fwrite(&cp, sizeof(cp), 1, f);
+    fclose(f);
+    if (written == 1)
+        MoveFileEx(tmpPath, checkpointPath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+    else
+        DeleteFile(tmpPath);
+}
+
+// Restores estimator state; a missing, stale-format or corrupt checkpoint is
+// ignored and the estimator starts cold as before.
+bool LoadCheckpoint() {
+    GetCheckpointPath();
+    FILE* f;
+    _tfopen_s(&f, checkpointPath, _T("rb"));
+    if (!f) return false;
+    EstimatorCheckpoint cp;
+    size_t n = fread(&cp, sizeof(cp), 1, f);
+    fclose(f);
+    if (n != 1 || cp.magic != CHECKPOINT_MAGIC || cp.version != CHECKPOINT_VERSION || cp.size != sizeof(cp))
+        return false;
+    if (cp.checksum != Crc32(&cp, offsetof(EstimatorCheckpoint, checksum)))
+        return false;
+    for (int ac = 0; ac < 2; ++ac) {
+        estimatorRate[ac] = cp.ratePerHour[ac];
+        estimatorRateT[ac] = cp.rateT[ac];
+    }
+    dischargeSampleCount = cp.sampleCounts[0];
+    chargeSampleCount = cp.sampleCounts[1];
+    // An old window would "repair" the first new readings toward the load
+    // the machine had before it was shut down; keep only the counters then.
+    time_t age = time(NULL) - cp.saved;
+    if (age >= 0 && age * 1000 <= (time_t)CHECKPOINT_FILTER_INTERVALS * GetConfig().sampleIntervalMs) {
+        sampleFilter = cp.filter;
+    }
+    else {
+        sampleFilter.rejected = cp.filter.rejected;
+        sampleFilter.repaired = cp.filter.repaired;
+    }
+    return true;
 }
 
 int EstimateTimeFromHistory(int ac, int currentPercent, int* outRatePerHour, int* outSampleCount) {
@@ -154,34 +1452,30 @@ int EstimateTimeFromHistory(int ac, int currentPercent, int* outRatePerHour, int
     BatterySample samples[maxSamples];
     int n = ReadBatteryHistory(ac, samples, maxSamples);
     if (outSampleCount) *outSampleCount = n;
-    if (n < 2) return -1;
 
-    double totalPercent = 0.0;
-    double totalTime = 0.0;
-    int validIntervals = 0;
-    for (int i = 1; i < n; ++i) {
-        double dPercent = samples[i].percent - samples[i - 1].percent;
-        double dTime = difftime(samples[i].t, samples[i - 1].t) / 3600.0;
-        if (fabs(dTime) < 0.017 || dPercent == 0) continue;
-        totalPercent += dPercent;
-        totalTime += dTime;
-        ++validIntervals;
-    }
-    if (validIntervals == 0) {
-        double dPercent = samples[n - 1].percent - samples[0].percent;
-        double dTime = difftime(samples[n - 1].t, samples[0].t) / 3600.0;
-        if (fabs(dTime) < 0.017 || dPercent == 0) return -1;
-        totalPercent = dPercent;
-        totalTime = dTime;
-    }
-    if (fabs(totalTime) < 0.017 || totalPercent == 0) return -1;
-
-    int ratePerHour = (int)(totalPercent / totalTime);
+    int slot = ac ? 1 : 0;
+    double rate = 0.0;
+    if (n >= 2 && FitHistoryRate(samples, n, &rate)) {
+        estimatorRate[slot] = rate;
+        estimatorRateT[slot] = time(NULL);
+    }
+    else if (estimatorRateT[slot] != 0 && time(NULL) - estimatorRateT[slot] <= CHECKPOINT_MAX_AGE) {
+        // Not enough fresh history yet: carry the last fit over from the checkpoint.
+        rate = estimatorRate[slot];
+    }
+    else {
+        return -1;
+    }
+
+    int ratePerHour = (int)rate;
     *outRatePerHour = ratePerHour;
 
     int minutes = 0;
     if (ac) {
-        if (ratePerHour > 0)
+        int curveTime = EstimateTimeToFull(currentPercent, rate > 0 ? 60.0 / rate : 0.0);
+        if (curveTime > 0)
+            minutes = (curveTime + 30) / 60;
+        else if (ratePerHour > 0)
             minutes = (int)((100 - currentPercent) * 60.0 / ratePerHour + 0.5);
         else
             minutes = 24 * 60;
@@ -195,41 +1489,31 @@ int EstimateTimeFromHistory(int ac, int currentPercent, int* outRatePerHour, int
     return (minutes > 0) ? minutes * 60 : -1;
 }
 
-void GetIniPath() {
-    if (!iniPath[0]) {
-        GetModuleFileName(NULL, iniPath, MAX_PATH);
-        TCHAR* p = _tcsrchr(iniPath, _T('\\'));
-        if (p) *(p + 1) = 0;
-        _tcscat_s(iniPath, MAX_PATH, _T("BatteryStatus.ini"));
-    }
-}
-
 void SaveToolbarPosition() {
     if (!hToolbarWnd) return;
     RECT rc;
     GetWindowRect(hToolbarWnd, &rc);
-    GetIniPath();
-    TCHAR posbuf[64];
-    StringCchPrintf(posbuf, 64, _T("%d,%d"), rc.left, rc.top);
-    WritePrivateProfileString(_T("Toolbar"), _T("Position"), posbuf, iniPath);
+    GetConfig();
+    if (config.toolbarX == rc.left && config.toolbarY == rc.top) return;
+    config.toolbarX = rc.left;
+    config.toolbarY = rc.top;
+    MarkConfigDirty(CONFIG_DIRTY_POSITION);
 }
 
 void LoadToolbarPosition(int* px, int* py) {
-    GetIniPath();
-    TCHAR posbuf[64];
-    GetPrivateProfileString(_T("Toolbar"), _T("Position"), _T("100,100"), posbuf, 64, iniPath);
-    _stscanf_s(posbuf, _T("%d,%d"), px, py);
+    *px = GetConfig().toolbarX;
+    *py = GetConfig().toolbarY;
 }
 
 void SaveToolbarVisible(bool visible) {
-    GetIniPath();
-    WritePrivateProfileString(_T("Toolbar"), _T("Visible"), visible ? _T("1") : _T("0"), iniPath);
+    GetConfig();
+    if (config.toolbarVisible == visible) return;
+    config.toolbarVisible = visible;
+    MarkConfigDirty(CONFIG_DIRTY_VISIBLE);
 }
 
 bool LoadToolbarVisible() {
-    GetIniPath();
-    int val = GetPrivateProfileInt(_T("Toolbar"), _T("Visible"), 1, iniPath);
-    return val != 0;
+    return GetConfig().toolbarVisible;
 }
 
 bool IsAutoStartEnabled() {
@@ -291,6 +1575,9 @@ bool GetBatterySmartStatus(
             if (charging && rate > 0) {
                 int diff = (int)(sbs.MaxCapacity - sbs.RemainingCapacity);
                 timeSec = (int)((diff * 3600.0) / rate + 0.5);
+                int curveTime = EstimateTimeToFull(percent, sbs.MaxCapacity * 0.6 / rate);
+                if (curveTime > 0)
+                    timeSec = curveTime;
                 haveSmartTime = true;
             }
             else if (!charging && rate < 0) {
@@ -299,15 +1586,279 @@ bool GetBatterySmartStatus(
             }
         }
     }
-    if (!GetSystemPowerStatus(&sps))
-        return haveSmartTime;
-    if (percent == 100) percent = sps.BatteryLifePercent;
-    acLineStatus = sps.ACLineStatus;
-    batteryFlag = sps.BatteryFlag;
-    if (!haveSmartTime) {
-        timeSec = (charging ? sps.BatteryFullLifeTime : sps.BatteryLifeTime);
+    if (!GetSystemPowerStatus(&sps))
+        return haveSmartTime;
+    if (percent == 100) percent = sps.BatteryLifePercent;
+    acLineStatus = sps.ACLineStatus;
+    batteryFlag = sps.BatteryFlag;
+    if (!haveSmartTime) {
+        timeSec = (charging ? sps.BatteryFullLifeTime : sps.BatteryLifeTime);
+    }
+    return haveSmartTime;
+}
+
+// --- Battery Driver Telemetry ---
+// Cost of telemetry snapshots, counted in OS calls (device enumeration, open,
+// IOCTL, close) and time. Kept for the persistent handle and, for comparison
+// in /selftest, for reopening the device on every read.
+struct TelemetryCost {
+    unsigned int reads;
+    unsigned int calls;
+    LONGLONG ticks;
+};
+
+TelemetryCost persistentCost = { 0 };
+TelemetryCost reopenCost = { 0 };
+unsigned int batteryCalls = 0;
+
+void AddTelemetryCost(TelemetryCost& c, unsigned int callsBefore, const LARGE_INTEGER& start) {
+    LARGE_INTEGER end;
+    QueryPerformanceCounter(&end);
+    c.calls += batteryCalls - callsBefore;
+    c.ticks += end.QuadPart - start.QuadPart;
+    ++c.reads;
+}
+
+// Fails with ERROR_NO_MORE_ITEMS when no battery is present.
+HANDLE OpenBatteryDevice(ULONG* tag) {
+    *tag = 0;
+    ++batteryCalls;
+    HDEVINFO hdev = SetupDiGetClassDevs(&GUID_DEVCLASS_BATTERY, 0, 0, DIGCF_PRESENT | DIGCF_DEVICEINTERFACE);
+    if (hdev == INVALID_HANDLE_VALUE) return INVALID_HANDLE_VALUE;
+    HANDLE h = INVALID_HANDLE_VALUE;
+    SP_DEVICE_INTERFACE_DATA did = { sizeof(did) };
+    ++batteryCalls;
+    bool found = SetupDiEnumDeviceInterfaces(hdev, 0, &GUID_DEVCLASS_BATTERY, 0, &did) != FALSE;
+    DWORD enumError = found ? ERROR_SUCCESS : GetLastError();
+    if (found) {
+        DWORD cb = 0;
+        ++batteryCalls;
+        SetupDiGetDeviceInterfaceDetail(hdev, &did, 0, 0, &cb, 0);
+        PSP_DEVICE_INTERFACE_DETAIL_DATA pdidd = (PSP_DEVICE_INTERFACE_DETAIL_DATA)LocalAlloc(LPTR, cb);
+        if (pdidd) {
+            pdidd->cbSize = sizeof(*pdidd);
+            ++batteryCalls;
+            if (SetupDiGetDeviceInterfaceDetail(hdev, &did, pdidd, cb, &cb, 0)) {
+                ++batteryCalls;
+                h = CreateFile(pdidd->DevicePath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                    NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            }
+            LocalFree(pdidd);
+        }
+    }
+    ++batteryCalls;
+    SetupDiDestroyDeviceInfoList(hdev);
+    if (!found) SetLastError(enumError);
+    if (h == INVALID_HANDLE_VALUE) return h;
+
+    DWORD wait = 0, out = 0;
+    ++batteryCalls;
+    if (!DeviceIoControl(h, IOCTL_BATTERY_QUERY_TAG, &wait, sizeof(wait), tag, sizeof(*tag), &out, NULL) || !*tag) {
+        ++batteryCalls;
+        CloseHandle(h);
+        return INVALID_HANDLE_VALUE;
+    }
+    return h;
+}
+
+// Fills the fields a query returned; bs and bi may be NULL and temp 0 when
+// that query was skipped or failed. Capacities count as mWh only when bi says
+// they are absolute; relative units would corrupt the wear ledger.
+void DecodeTelemetry(const BATTERY_STATUS* bs, ULONG temp, const BATTERY_INFORMATION* bi, BatteryTelemetry* tel) {
+    bool milliWattHours = bi && !(bi->Capabilities & BATTERY_CAPACITY_RELATIVE);
+    if (bs && bs->Voltage != BATTERY_UNKNOWN_VOLTAGE && bs->Voltage != 0) {
+        tel->milliVolts = (int)bs->Voltage;
+        tel->present |= TELEMETRY_VOLTAGE;
+        if (bs->Rate != BATTERY_UNKNOWN_RATE) {
+            tel->milliAmps = (int)((LONGLONG)(LONG)bs->Rate * 1000 / (LONG)bs->Voltage);
+            tel->present |= TELEMETRY_CURRENT;
+        }
+    }
+    if (milliWattHours && bs && bs->Capacity != BATTERY_UNKNOWN_CAPACITY) {
+        tel->chargeMilliWattHours = (int)bs->Capacity;
+        tel->present |= TELEMETRY_CHARGE;
+    }
+    if (temp) {
+        tel->deciCelsius = (int)temp - 2732;
+        tel->present |= TELEMETRY_TEMP;
+    }
+    if (bi && bi->CycleCount) {
+        tel->cycleCount = (int)bi->CycleCount;
+        tel->present |= TELEMETRY_CYCLES;
+    }
+    if (milliWattHours && bi->FullChargedCapacity) {
+        tel->fullMilliWattHours = (int)bi->FullChargedCapacity;
+        tel->present |= TELEMETRY_FULL;
+    }
+    if (milliWattHours && bi->DesignedCapacity) {
+        tel->designMilliWattHours = (int)bi->DesignedCapacity;
+        tel->present |= TELEMETRY_DESIGN;
+    }
+}
+
+// The battery handle stays open across ticks; it is dropped on a device
+// arrival/removal notification or a failed query and reopened on next use.
+// Finding no battery at all is remembered until the next arrival, so a
+// desktop does not enumerate devices on every tick.
+HANDLE hBattery = INVALID_HANDLE_VALUE;
+bool batteryMissing = false;
+ULONG batteryTag = 0;
+HDEVNOTIFY hBatteryNotify = NULL;
+BATTERY_INFORMATION batteryInfo = { 0 };
+bool batteryInfoValid = false;
+ULONGLONG batteryInfoTick = 0;
+bool batteryTempSupported = true;
+
+void CloseBatteryDevice() {
+    if (hBattery != INVALID_HANDLE_VALUE) {
+        ++batteryCalls;
+        CloseHandle(hBattery);
+    }
+    hBattery = INVALID_HANDLE_VALUE;
+    batteryTag = 0;
+    batteryInfoValid = false;
+    batteryTempSupported = true;
+}
+
+bool QueryBatteryStatus(BATTERY_STATUS* bs) {
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        if (hBattery == INVALID_HANDLE_VALUE) {
+            if (batteryMissing) return false;
+            hBattery = OpenBatteryDevice(&batteryTag);
+            if (hBattery == INVALID_HANDLE_VALUE) {
+                batteryMissing = GetLastError() == ERROR_NO_MORE_ITEMS;
+                return false;
+            }
+        }
+        DWORD out = 0;
+        BATTERY_WAIT_STATUS bws = { 0 };
+        bws.BatteryTag = batteryTag;
+        ++batteryCalls;
+        if (DeviceIoControl(hBattery, IOCTL_BATTERY_QUERY_STATUS, &bws, sizeof(bws), bs, sizeof(*bs), &out, NULL))
+            return true;
+        // The tag changes when the battery is swapped; reopen and try once more.
+        CloseBatteryDevice();
+    }
+    return false;
+}
+
+// Reads all optional fields over the persistent handle: one status query,
+// a temperature query only if the driver supports it, and the slow-changing
+// BatteryInformation at most every ten minutes.
+bool ReadBatteryTelemetry(BatteryTelemetry* tel) {
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    unsigned int callsBefore = batteryCalls;
+    memset(tel, 0, sizeof(BatteryTelemetry));
+
+    BATTERY_STATUS bs;
+    if (!QueryBatteryStatus(&bs))
+        return false;
+
+    DWORD out = 0;
+    ULONG temp = 0;
+    BATTERY_QUERY_INFORMATION bqi = { 0 };
+    bqi.BatteryTag = batteryTag;
+    if (batteryTempSupported) {
+        bqi.InformationLevel = BatteryTemperature;
+        ++batteryCalls;
+        if (!DeviceIoControl(hBattery, IOCTL_BATTERY_QUERY_INFORMATION, &bqi, sizeof(bqi), &temp, sizeof(temp), &out, NULL)) {
+            if (GetLastError() == ERROR_INVALID_FUNCTION)
+                batteryTempSupported = false;
+            temp = 0;
+        }
+    }
+
+    ULONGLONG now = GetTickCount64();
+    if (!batteryInfoValid || now - batteryInfoTick > 10 * 60 * 1000) {
+        bqi.InformationLevel = BatteryInformation;
+        ++batteryCalls;
+        batteryInfoValid = DeviceIoControl(hBattery, IOCTL_BATTERY_QUERY_INFORMATION, &bqi, sizeof(bqi), &batteryInfo, sizeof(batteryInfo), &out, NULL) != FALSE;
+        batteryInfoTick = now;
+    }
+    DecodeTelemetry(&bs, temp, batteryInfoValid ? &batteryInfo : NULL, tel);
+
+    AddTelemetryCost(persistentCost, callsBefore, start);
+    return tel->present != 0;
+}
+
+// The open-per-read approach the persistent handle replaced: enumerate, open
+// and tag the device, query everything, close. Only run to measure the cost.
+bool ReadBatteryTelemetryReopen(BatteryTelemetry* tel) {
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    unsigned int callsBefore = batteryCalls;
+    memset(tel, 0, sizeof(BatteryTelemetry));
+
+    ULONG tag = 0;
+    HANDLE h = OpenBatteryDevice(&tag);
+    if (h == INVALID_HANDLE_VALUE)
+        return false;
+    DWORD out = 0;
+    BATTERY_WAIT_STATUS bws = { 0 };
+    bws.BatteryTag = tag;
+    BATTERY_STATUS bs;
+    ++batteryCalls;
+    bool haveStatus = DeviceIoControl(h, IOCTL_BATTERY_QUERY_STATUS, &bws, sizeof(bws), &bs, sizeof(bs), &out, NULL) != FALSE;
+
+    BATTERY_QUERY_INFORMATION bqi = { 0 };
+    bqi.BatteryTag = tag;
+    bqi.InformationLevel = BatteryTemperature;
+    ULONG temp = 0;
+    ++batteryCalls;
+    if (!DeviceIoControl(h, IOCTL_BATTERY_QUERY_INFORMATION, &bqi, sizeof(bqi), &temp, sizeof(temp), &out, NULL))
+        temp = 0;
+    BATTERY_INFORMATION bi;
+    bqi.InformationLevel = BatteryInformation;
+    ++batteryCalls;
+    bool haveInfo = DeviceIoControl(h, IOCTL_BATTERY_QUERY_INFORMATION, &bqi, sizeof(bqi), &bi, sizeof(bi), &out, NULL) != FALSE;
+    ++batteryCalls;
+    CloseHandle(h);
+    DecodeTelemetry(haveStatus ? &bs : NULL, temp, haveInfo ? &bi : NULL, tel);
+
+    AddTelemetryCost(reopenCost, callsBefore, start);
+    return tel->present != 0;
+}
+
+void FormatTelemetryCost(const TCHAR* name, const TelemetryCost& c, TCHAR* buf, size_t len) {
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    unsigned int reads = (std::max)(c.reads, 1u);
+    StringCchPrintf(buf, len, _T("%s: %.1f calls, %.0f us per read\n"),
+        name, (double)c.calls / reads, c.ticks * 1e6 / freq.QuadPart / reads);
+}
+
+void RegisterBatteryNotification(HWND hwnd) {
+    DEV_BROADCAST_DEVICEINTERFACE filter = { 0 };
+    filter.dbcc_size = sizeof(filter);
+    filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+    filter.dbcc_classguid = GUID_DEVCLASS_BATTERY;
+    hBatteryNotify = RegisterDeviceNotification(hwnd, &filter, DEVICE_NOTIFY_WINDOW_HANDLE);
+}
+
+void FormatTelemetry(const BatteryTelemetry& tel, TCHAR* buf, size_t len) {
+    buf[0] = 0;
+    TCHAR line[64];
+    if (tel.present & TELEMETRY_VOLTAGE) {
+        StringCchPrintf(line, _countof(line), _T("Voltage: %.2f V\n"), tel.milliVolts / 1000.0);
+        StringCchCat(buf, len, line);
+    }
+    if (tel.present & TELEMETRY_CURRENT) {
+        StringCchPrintf(line, _countof(line), _T("Current: %d mA\n"), tel.milliAmps);
+        StringCchCat(buf, len, line);
+    }
+    if (tel.present & TELEMETRY_TEMP) {
+        StringCchPrintf(line, _countof(line), _T("Temperature: %.1f C\n"), tel.deciCelsius / 10.0);
+        StringCchCat(buf, len, line);
+    }
+    if (tel.present & TELEMETRY_CYCLES) {
+        StringCchPrintf(line, _countof(line), _T("Cycle Count: %d\n"), tel.cycleCount);
+        StringCchCat(buf, len, line);
+    }
+    if (tel.present & TELEMETRY_CHARGE) {
+        StringCchPrintf(line, _countof(line), _T("Charge: %d mWh\n"), tel.chargeMilliWattHours);
+        StringCchCat(buf, len, line);
     }
-    return haveSmartTime;
 }
 
 void DrawBatteryBox(HDC hdc, int x, int y, int w, int h, int percent, bool charging, bool low) {
@@ -366,6 +1917,138 @@ void DrawBatteryBox(HDC hdc, int x, int y, int w, int h, int percent, bool charg
     }
 }
 
+// --- Tray Icon Sprites ---
+// The battery glyph of DrawBatteryBox rendered into a plain 32-bit ARGB
+// buffer, so the renderer needs no device context. Every percent/charging/low
+// variant is built once per icon size; a tray update is a table lookup.
+#define SPRITE_LEVELS 101
+#define SPRITE_ARGB(r, g, b) (0xFF000000u | ((DWORD)(r) << 16) | ((DWORD)(g) << 8) | (DWORD)(b))
+
+struct SpriteCache {
+    int size;
+    HICON icons[SPRITE_LEVELS][2][2];
+};
+
+SpriteCache spriteCache = { 0 };
+
+void FillSpriteRect(DWORD* px, int size, int left, int top, int right, int bottom, DWORD color) {
+    left = (std::max)(left, 0);
+    top = (std::max)(top, 0);
+    right = (std::min)(right, size);
+    bottom = (std::min)(bottom, size);
+    for (int y = top; y < bottom; ++y)
+        for (int x = left; x < right; ++x)
+            px[y * size + x] = color;
+}
+
+void DrawSpriteLine(DWORD* px, int size, double x0, double y0, double x1, double y1, int thickness, DWORD color) {
+    int steps = (int)(std::max)(fabs(x1 - x0), fabs(y1 - y0)) + 1;
+    for (int i = 0; i <= steps; ++i) {
+        int x = (int)(x0 + (x1 - x0) * i / steps + 0.5);
+        int y = (int)(y0 + (y1 - y0) * i / steps + 0.5);
+        FillSpriteRect(px, size, x, y, x + thickness, y + thickness, color);
+    }
+}
+
+// Renders a size x size top-down ARGB image; transparent outside the battery.
+void RenderBatterySprite(DWORD* px, int size, int percent, bool charging, bool low) {
+    double k = size / 16.0;
+    int stroke = (std::max)(1, (int)(k + 0.5));
+    memset(px, 0, size * size * sizeof(DWORD));
+
+    int bodyTop = (int)(3 * k + 0.5), bodyRight = size - 1, bodyBottom = size - 1;
+    FillSpriteRect(px, size, 0, bodyTop, bodyRight, bodyBottom, SPRITE_ARGB(255, 255, 255));
+    FillSpriteRect(px, size, 0, bodyTop, bodyRight, bodyTop + stroke, SPRITE_ARGB(0, 0, 0));
+    FillSpriteRect(px, size, 0, bodyBottom - stroke, bodyRight, bodyBottom, SPRITE_ARGB(0, 0, 0));
+    FillSpriteRect(px, size, 0, bodyTop, stroke, bodyBottom, SPRITE_ARGB(0, 0, 0));
+    FillSpriteRect(px, size, bodyRight - stroke, bodyTop, bodyRight, bodyBottom, SPRITE_ARGB(0, 0, 0));
+
+    int tipW = size / 2;
+    int tipX = (size - tipW) / 2;
+    FillSpriteRect(px, size, tipX, 0, tipX + tipW, (int)(4 * k + 0.5), SPRITE_ARGB(0, 0, 0));
+
+    int margin = (int)(2 * k + 0.5);
+    int fillable = bodyBottom - bodyTop - 2 * margin;
+    int fillTop = bodyBottom - margin - fillable * percent / 100;
+    DWORD fill = low ? SPRITE_ARGB(255, 64, 64) : charging ? SPRITE_ARGB(128, 255, 128) : SPRITE_ARGB(255, 255, 128);
+    FillSpriteRect(px, size, margin, fillTop, bodyRight - margin, bodyBottom - margin, fill);
+
+    if (charging) {
+        static const double bolt[][2] = { { -3, 2 }, { 0, 6 }, { -2, 6 }, { 3, 13 }, { 1, 7 }, { 4, 7 }, { 1, 2 } };
+        double cx = size / 2.0, cy = size / 2.0 - 6 * k;
+        for (int i = 1; i < _countof(bolt); ++i) {
+            DrawSpriteLine(px, size,
+                cx + bolt[i - 1][0] * k, cy + bolt[i - 1][1] * k,
+                cx + bolt[i][0] * k, cy + bolt[i][1] * k,
+                stroke, SPRITE_ARGB(0, 192, 0));
+        }
+    }
+}
+
+// AND mask from the sprite's alpha channel: set bits are transparent. Rows of
+// a monochrome bitmap are padded to 16 bits.
+HBITMAP CreateSpriteMask(const DWORD* px, int size) {
+    int stride = (size + 15) / 16 * 2;
+    std::vector<BYTE> bits(stride * size, 0);
+    for (int y = 0; y < size; ++y)
+        for (int x = 0; x < size; ++x)
+            if ((px[y * size + x] >> 24) == 0)
+                bits[y * stride + x / 8] |= (BYTE)(0x80 >> (x % 8));
+    return CreateBitmap(size, size, 1, 1, bits.data());
+}
+
+HICON CreateIconFromSprite(const DWORD* px, int size) {
+    BITMAPINFO bmi = { 0 };
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = size;
+    bmi.bmiHeader.biHeight = -size;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+    void* bits = nullptr;
+    HBITMAP hColor = CreateDIBSection(NULL, &bmi, DIB_RGB_COLORS, &bits, NULL, 0);
+    if (!hColor) return NULL;
+    memcpy(bits, px, size * size * sizeof(DWORD));
+    HBITMAP hMask = CreateSpriteMask(px, size);
+    ICONINFO ii = { TRUE, 0, 0, hMask, hColor };
+    HICON hIcon = CreateIconIndirect(&ii);
+    DeleteObject(hMask);
+    DeleteObject(hColor);
+    return hIcon;
+}
+
+void FreeSpriteCache() {
+    for (int p = 0; p < SPRITE_LEVELS; ++p)
+        for (int c = 0; c < 2; ++c)
+            for (int l = 0; l < 2; ++l)
+                if (spriteCache.icons[p][c][l]) DestroyIcon(spriteCache.icons[p][c][l]);
+    memset(&spriteCache, 0, sizeof(spriteCache));
+}
+
+void BuildSpriteCache(int size) {
+    FreeSpriteCache();
+    std::vector<DWORD> px(size * size);
+    for (int p = 0; p < SPRITE_LEVELS; ++p) {
+        for (int c = 0; c < 2; ++c) {
+            for (int l = 0; l < 2; ++l) {
+                RenderBatterySprite(px.data(), size, p, c != 0, l != 0);
+                spriteCache.icons[p][c][l] = CreateIconFromSprite(px.data(), size);
+            }
+        }
+    }
+    spriteCache.size = size;
+}
+
+// Returns the cached icon for a reading, rebuilding the cache if the small
+// icon size changed (DPI or display settings).
+HICON GetBatterySpriteIcon(int percent, bool charging, bool low) {
+    int size = GetSystemMetrics(SM_CXSMICON);
+    if (spriteCache.size != size)
+        BuildSpriteCache(size);
+    percent = (std::max)(0, (std::min)(percent, 100));
+    return spriteCache.icons[percent][charging ? 1 : 0][low ? 1 : 0];
+}
+
 void FormatTime(int seconds, bool charging, TCHAR* buf, size_t len) {
     if (seconds < 0 || seconds > 24 * 3600) {
         StringCchCopy(buf, len, charging ? _T("-?:??") : _T("?:??"));
@@ -461,6 +2144,226 @@ bool GetBatteryCapacities(ULONG* design, ULONG* full) {
     return gotData;
 }
 
+// --- Shared-Memory Live Status ---
+// Held by the instance that publishes. The section itself may outlive a
+// writer because readers keep it mapped, so it cannot decide ownership.
+#define LIVE_WRITER_MUTEX _T("Local\\BatteryStatusLiveWriter")
+HANDLE hLiveWriter = NULL;
+
+void OpenLiveSegment() {
+    hLiveWriter = CreateMutex(NULL, FALSE, LIVE_WRITER_MUTEX);
+    if (!hLiveWriter) return;
+    DWORD wait = WaitForSingleObject(hLiveWriter, 0);
+    if (wait != WAIT_OBJECT_0 && wait != WAIT_ABANDONED) {
+        // Another instance is publishing; a second writer would break the seqlock.
+        CloseHandle(hLiveWriter);
+        hLiveWriter = NULL;
+        return;
+    }
+    hLiveMapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(BatteryLiveSegment), BATTERY_SHM_NAME);
+    bool existed = hLiveMapping && GetLastError() == ERROR_ALREADY_EXISTS;
+    if (hLiveMapping)
+        liveSegment = (BatteryLiveSegment*)MapViewOfFile(hLiveMapping, FILE_MAP_WRITE, 0, 0, sizeof(BatteryLiveSegment));
+    if (liveSegment && existed && liveSegment->version != 0 &&
+        (liveSegment->version != BATTERY_SHM_VERSION || liveSegment->size != sizeof(BatteryLiveSegment))) {
+        // A reader still holds a section from an incompatible build.
+        UnmapViewOfFile(liveSegment);
+        liveSegment = nullptr;
+    }
+    if (!liveSegment) {
+        if (hLiveMapping) CloseHandle(hLiveMapping);
+        hLiveMapping = NULL;
+        ReleaseMutex(hLiveWriter);
+        CloseHandle(hLiveWriter);
+        hLiveWriter = NULL;
+        return;
+    }
+    // A section left by an earlier writer keeps its generation counting up;
+    // if that writer died mid-update, close its sequence so readers see data.
+    if (liveSegment->sequence & 1)
+        InterlockedIncrement(&liveSegment->sequence);
+    liveSegment->size = sizeof(BatteryLiveSegment);
+    liveSegment->version = BATTERY_SHM_VERSION;
+
+    ULONG design = 0, full = 0;
+    if (GetBatteryCapacities(&design, &full) && full <= design)
+        liveWearTenths = (int)(1000.0 * (1.0 - (double)full / (double)design) + 0.5);
+}
+
+void CloseLiveSegment() {
+    CloseBatteryLiveSegment(liveSegment, hLiveMapping);
+    liveSegment = nullptr;
+    hLiveMapping = NULL;
+    if (hLiveWriter) {
+        ReleaseMutex(hLiveWriter);
+        CloseHandle(hLiveWriter);
+        hLiveWriter = NULL;
+    }
+}
+
+void PublishLiveStatus(int percent, int acLineStatus, int batteryFlag, bool charging, int milliWatts, int timeSec, int histTime) {
+    if (!liveSegment) return;
+    BatteryLiveStatus st;
+    st.percent = percent;
+    st.acLineStatus = acLineStatus;
+    st.batteryFlag = batteryFlag;
+    st.charging = charging ? 1 : 0;
+    st.milliWatts = milliWatts;
+    st.windowsTimeSec = timeSec > 0 ? timeSec : -1;
+    st.historyTimeSec = histTime > 0 ? histTime : -1;
+    st.wearTenths = liveWearTenths;
+    st.dischargeSamples = dischargeSampleCount;
+    st.chargeSamples = chargeSampleCount;
+    st.updated = (LONGLONG)time(NULL);
+    st.generation = liveSegment->status.generation + 1;
+
+    InterlockedIncrement(&liveSegment->sequence);
+    liveSegment->status = st;
+    InterlockedIncrement(&liveSegment->sequence);
+}
+
+// Latest reading taken by SampleBattery; the toolbar and tray paint from it.
+struct BatteryReading {
+    bool valid;
+    int percent;
+    int timeSec;
+    bool charging;
+    double watts;
+    bool haveWatt;
+    int acLineStatus;
+    int batteryFlag;
+    int milliWatts;
+    int histTime;
+    int ratePerHour;
+    int sampleCount;
+};
+
+BatteryReading latestReading = { 0 };
+
+// Tray tooltip text for the latest (filtered) reading, so the tray and the
+// toolbar always agree.
+void GetBatteryStatusString(TCHAR* buf, size_t len) {
+    const BatteryReading& r = latestReading;
+    if (!r.valid) {
+        StringCchCopy(buf, len, _T("N/A"));
+        return;
+    }
+    TCHAR ac[16] = _T("");
+    switch (r.acLineStatus) {
+    case 0: _tcscpy_s(ac, _T("On Battery")); break;
+    case 1: _tcscpy_s(ac, _T("Plugged In")); break;
+    default: _tcscpy_s(ac, _T("Unknown")); break;
+    }
+    TCHAR bat[16] = _T("");
+    if (r.batteryFlag & 128) {
+        StringCchCopy(buf, len, _T("A/C"));
+        return;
+    }
+    else if (r.percent == 100 && r.acLineStatus == 1) {
+        StringCchCopy(buf, len, _T("A/C"));
+        return;
+    }
+    else if (r.percent == 255) {
+        StringCchCopy(buf, len, _T("N/A"));
+        return;
+    }
+    if (r.charging) {
+        _tcscpy_s(bat, _T("Charging"));
+    }
+    else {
+        switch (r.batteryFlag) {
+        case 1: _tcscpy_s(bat, _T("High")); break;
+        case 2: _tcscpy_s(bat, _T("Low")); break;
+        case 4: _tcscpy_s(bat, _T("Critical")); break;
+        default: _tcscpy_s(bat, _T("Normal")); break;
+        }
+    }
+    StringCchPrintf(buf, len, _T("Battery: %d%% (%s, %s)"), r.percent, ac, bat);
+}
+
+// Called by SampleBattery; only touches the shell when the text or icon changed.
+void UpdateTrayIcon() {
+    const BatteryReading& r = latestReading;
+    TCHAR tip[128];
+    GetBatteryStatusString(tip, _countof(tip));
+    nid.uFlags = 0;
+    if (_tcscmp(tip, nid.szTip) != 0) {
+        StringCchCopy(nid.szTip, _countof(nid.szTip), tip);
+        nid.uFlags |= NIF_TIP;
+    }
+
+    if (r.valid && r.percent <= 100 && !(r.batteryFlag & 128)) {
+        HICON hIcon = GetBatterySpriteIcon(r.percent, r.charging, r.percent <= 10);
+        if (hIcon && hIcon != nid.hIcon) {
+            nid.hIcon = hIcon;
+            nid.uFlags |= NIF_ICON;
+        }
+    }
+    if (nid.uFlags)
+        Shell_NotifyIcon(NIM_MODIFY, &nid);
+}
+
+// Runs on the sampling timer whether or not the toolbar is shown: logs the
+// sample (which evaluates the alert rules), refreshes the estimate, publishes
+// it and updates the tray icon and toolbar.
+void SampleBattery() {
+    BatteryReading r = { 0 };
+    bool haveSmartTime = false;
+    GetBatterySmartStatus(r.percent, r.timeSec, r.charging, r.watts, r.haveWatt, haveSmartTime, r.acLineStatus, r.batteryFlag, r.milliWatts);
+
+    BatteryTelemetry telemetry;
+    ReadBatteryTelemetry(&telemetry);
+    BatterySample s = { 0 };
+    s.percent = r.percent;
+    s.milliWatts = r.milliWatts;
+    LogBatterySample(r.percent, r.acLineStatus, r.haveWatt ? (int)r.watts : 0, r.milliWatts, r.batteryFlag, &telemetry, &s);
+    // Show and estimate from the filtered sample so a glitch never reaches the screen.
+    r.percent = s.percent;
+    if (s.milliWatts != r.milliWatts) {
+        r.milliWatts = s.milliWatts;
+        r.watts = s.milliWatts / 1000.0;
+        r.haveWatt = s.milliWatts > 0;
+    }
+
+    r.histTime = EstimateTimeFromHistory(r.acLineStatus, r.percent, &r.ratePerHour, &r.sampleCount);
+    r.valid = true;
+    latestReading = r;
+    PublishLiveStatus(r.percent, r.acLineStatus, r.batteryFlag, r.charging, r.milliWatts, r.timeSec, r.histTime);
+    UpdateTrayIcon();
+    if (toolbarVisible && hToolbarWnd)
+        InvalidateRect(hToolbarWnd, NULL, FALSE);
+}
+
+// Sends stdout to the console of the shell that started us, or a new one.
+void AttachOutputConsole() {
+    if (!GetConsoleWindow() && !AttachConsole(ATTACH_PARENT_PROCESS))
+        AllocConsole();
+    FILE* out = nullptr;
+    _tfreopen_s(&out, _T("CONOUT$"), _T("w"), stdout);
+}
+
+// Handles "BatteryStatus.exe /status": prints the live segment as key=value lines.
+int PrintLiveStatus() {
+    AttachOutputConsole();
+
+    HANDLE mapping = NULL;
+    BatteryLiveSegment* seg = OpenBatteryLiveSegment(&mapping);
+    BatteryLiveStatus st;
+    if (!seg || !ReadBatteryLiveStatus(seg, &st)) {
+        _tprintf(_T("BatteryStatus is not running\n"));
+        CloseBatteryLiveSegment(seg, mapping);
+        return 1;
+    }
+    _tprintf(_T("percent=%d\nac=%d\nflag=%d\ncharging=%d\nmilliwatts=%d\n"),
+        st.percent, st.acLineStatus, st.batteryFlag, st.charging, st.milliWatts);
+    _tprintf(_T("windows_time=%d\nhistory_time=%d\nwear_tenths=%d\n"),
+        st.windowsTimeSec, st.historyTimeSec, st.wearTenths);
+    _tprintf(_T("discharge_samples=%d\ncharge_samples=%d\nupdated=%I64d\ngeneration=%I64u\n"),
+        st.dischargeSamples, st.chargeSamples, st.updated, st.generation);
+    CloseBatteryLiveSegment(seg, mapping);
+    return 0;
+}
+
 void ShowToolbarTooltip(HWND hwnd) {
     if (!hTooltip) {
         hTooltip = CreateWindowEx(WS_EX_TOPMOST, TOOLTIPS_CLASS, NULL,
@@ -480,14 +2383,9 @@ void ShowToolbarTooltip(HWND hwnd) {
         SendMessage(hTooltip, TTM_ADDTOOL, 0, (LPARAM)&ti);
     }
 
-    int percent = 0, timeSec = 0, acLineStatus = 0, batteryFlag = 0, milliWatts = 0;
-    bool charging = false, haveWatt = false, haveSmartTime = false;
-    double watts = 0;
-    GetBatterySmartStatus(percent, timeSec, charging, watts, haveWatt, haveSmartTime, acLineStatus, batteryFlag, milliWatts);
-
-    int ratePerHour = 0;
-    int sampleCount = 0;
-    int histTime = EstimateTimeFromHistory(acLineStatus, percent, &ratePerHour, &sampleCount);
+    const BatteryReading& r = latestReading;
+    int timeSec = r.timeSec, acLineStatus = r.acLineStatus, sampleCount = r.sampleCount, histTime = r.histTime;
+    bool charging = r.charging;
 
     TCHAR dbTime[32], sysTime[32];
     FormatTime(timeSec, charging, sysTime, _countof(sysTime));
@@ -501,10 +2399,30 @@ void ShowToolbarTooltip(HWND hwnd) {
         _tcscpy_s(dbTime, _T("N/A"));
     }
 
+    TCHAR forecast[96] = _T("");
+    BatteryDB db;
+    UsageForecast uf;
+    if (acLineStatus == 0 && LoadBatteryDB(&db) && ForecastNextCharge(db.usage, time(NULL), &uf)) {
+        struct tm lt;
+        localtime_s(&lt, &uf.nextPlugIn);
+        TCHAR when[32];
+        _tcsftime(when, _countof(when), _T("%a %H:00"), &lt);
+        // Prefer the modeled draw against the stored charge; fall back to the
+        // current drain estimate when either is missing.
+        BatteryTelemetry last;
+        LoadTelemetry(db.dischargeTelemetry, (db.idxDischarge + MAX_SAMPLES - 1) % MAX_SAMPLES, &last);
+        const TCHAR* verdict = _T("?");
+        if (uf.milliWattHoursNeeded > 0 && (last.present & TELEMETRY_CHARGE))
+            verdict = last.chargeMilliWattHours >= uf.milliWattHoursNeeded ? _T("covered") : _T("short");
+        else if (histTime > 0)
+            verdict = histTime >= uf.hoursUntil * 3600.0 ? _T("covered") : _T("short");
+        StringCchPrintf(forecast, _countof(forecast), _T("\r\nNext charge: %s (%s)"), when, verdict);
+    }
+
     static TCHAR tipText[256];
     StringCchPrintf(tipText, _countof(tipText),
-        _T("Estimate (History): %s\r\nEstimate (Windows): %s\r\nSamples: %d"),
-        dbTime, sysTime, sampleCount);
+        _T("Estimate (History): %s%s\r\nEstimate (Windows): %s\r\nSamples: %d"),
+        dbTime, forecast, sysTime, sampleCount);
 
     ti.lpszText = tipText;
     SendMessage(hTooltip, TTM_SETMAXTIPWIDTH, 0, 400);
@@ -515,7 +2433,7 @@ void ShowToolbarTooltip(HWND hwnd) {
     int screenW = GetSystemMetrics(SM_CXSCREEN);
     int screenH = GetSystemMetrics(SM_CYSCREEN);
 
-    int tipW = 220, tipH = 40;
+    int tipW = 220, tipH = forecast[0] ? 54 : 40;
     int tipX = rc.right;
     int tipY = rc.top;
     if (tipX + tipW > screenW) tipX = screenW - tipW;
@@ -536,14 +2454,8 @@ void HideToolbarTooltip() {
 LRESULT CALLBACK ToolbarProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
     static bool tooltipShown = false;
     switch (msg) {
-    case WM_CREATE:
-        SetTimer(hwnd, IDT_TOOLBAR, 3000, NULL);
-        break;
     case WM_ERASEBKGND:
         return 1;
-    case WM_TIMER:
-        InvalidateRect(hwnd, NULL, FALSE);
-        break;
     case WM_LBUTTONDOWN: {
         POINT pt;
         GetCursorPos(&pt);
@@ -606,12 +2518,12 @@ LRESULT CALLBACK ToolbarProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
         int toolbarW = width;
         int toolbarH = height;
 
-        int percent = 0, timeSec = 0, acLineStatus = 0, batteryFlag = 0, milliWatts = 0;
-        bool charging = false, haveWatt = false, haveSmartTime = false;
-        double watts = 0;
-        GetBatterySmartStatus(percent, timeSec, charging, watts, haveWatt, haveSmartTime, acLineStatus, batteryFlag, milliWatts);
-
-        LogBatterySample(percent, acLineStatus, haveWatt ? (int)watts : 0, milliWatts, batteryFlag);
+        // Sampling runs on the main window's timer; painting only shows the result.
+        const BatteryReading& r = latestReading;
+        int percent = r.percent, timeSec = r.timeSec, acLineStatus = r.acLineStatus, batteryFlag = r.batteryFlag;
+        bool charging = r.charging, haveWatt = r.haveWatt;
+        double watts = r.watts;
+        int histTime = r.histTime;
 
         bool low = percent <= 10;
         int boxX = 1, boxY = 2, boxW = 16, boxH = 16;
@@ -659,8 +2571,6 @@ LRESULT CALLBACK ToolbarProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
             StringCchCopy(textbuf, _countof(textbuf), _T("N/A"));
         }
         else {
-            int ratePerHour = 0, sampleCount = 0;
-            int histTime = EstimateTimeFromHistory(acLineStatus, percent, &ratePerHour, &sampleCount);
             int displayTime = histTime > 0 ? histTime : timeSec;
             FormatTime(displayTime, charging, timebuf, _countof(timebuf));
             StringCchPrintf(percentbuf, _countof(percentbuf), _T("%d%%"), percent);
@@ -698,9 +2608,6 @@ LRESULT CALLBACK ToolbarProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam)
         ShowWindow(hwnd, SW_HIDE);
         toolbarVisible = false;
         break;
-    case WM_DESTROY:
-        KillTimer(hwnd, IDT_TOOLBAR);
-        break;
     default:
         return DefWindowProc(hwnd, msg, wParam, lParam);
     }
@@ -742,59 +2649,13 @@ void HideToolbar() {
     HideToolbarTooltip();
 }
 
-void GetBatteryStatusString(TCHAR* buf, size_t len) {
-    SYSTEM_POWER_STATUS sps;
-    if (GetSystemPowerStatus(&sps)) {
-        TCHAR ac[16] = _T("");
-        switch (sps.ACLineStatus) {
-        case 0: _tcscpy_s(ac, _T("On Battery")); break;
-        case 1: _tcscpy_s(ac, _T("Plugged In")); break;
-        default: _tcscpy_s(ac, _T("Unknown")); break;
-        }
-        TCHAR bat[16] = _T("");
-        if (sps.BatteryFlag & 128) {
-            StringCchCopy(buf, len, _T("A/C"));
-            return;
-        }
-        else if (sps.BatteryLifePercent == 100 && sps.ACLineStatus == 1) {
-            StringCchCopy(buf, len, _T("A/C"));
-            return;
-        }
-        else if (sps.BatteryLifePercent == 255) {
-            StringCchCopy(buf, len, _T("N/A"));
-            return;
-        }
-        switch (sps.BatteryFlag) {
-        case 1: _tcscpy_s(bat, _T("High")); break;
-        case 2: _tcscpy_s(bat, _T("Low")); break;
-        case 4: _tcscpy_s(bat, _T("Critical")); break;
-        case 8: _tcscpy_s(bat, _T("Charging")); break;
-        default: _tcscpy_s(bat, _T("Normal")); break;
-        }
-        StringCchPrintf(buf, len, _T("Battery: %d%% (%s, %s)"), sps.BatteryLifePercent, ac, bat);
-    }
-    else {
-        StringCchCopy(buf, len, _T("N/A"));
-    }
-}
-
-void UpdateTrayIcon() {
-    TCHAR tip[128];
-    GetBatteryStatusString(tip, _countof(tip));
-    nid.uFlags = NIF_TIP;
-    StringCchCopy(nid.szTip, _countof(nid.szTip), tip);
-    Shell_NotifyIcon(NIM_MODIFY, &nid);
-}
-
 void ShowBatteryDetails(HWND parent) {
-    TCHAR buf[1024];
-    int percent = 0, timeSec = 0, acLineStatus = 0, batteryFlag = 0, milliWatts = 0;
-    bool charging = false, haveWatt = false, haveSmartTime = false;
-    double watts = 0;
-    GetBatterySmartStatus(percent, timeSec, charging, watts, haveWatt, haveSmartTime, acLineStatus, batteryFlag, milliWatts);
-
-    int ratePerHour = 0, sampleCount = 0;
-    int histTime = EstimateTimeFromHistory(acLineStatus, percent, &ratePerHour, &sampleCount);
+    TCHAR buf[2048];
+    const BatteryReading& r = latestReading;
+    int percent = r.percent, timeSec = r.timeSec, acLineStatus = r.acLineStatus, batteryFlag = r.batteryFlag;
+    bool charging = r.charging, haveWatt = r.haveWatt;
+    double watts = r.watts;
+    int histTime = r.histTime, sampleCount = r.sampleCount;
 
     TCHAR estbuf[32];
     if (histTime > 0) {
@@ -839,6 +2700,20 @@ void ShowBatteryDetails(HWND parent) {
         BatterySample samples[MAX_SAMPLES];
         int n = ReadBatteryHistory(acLineStatus, samples, MAX_SAMPLES);
         if (n > 1) {
+            double t[MAX_SAMPLES], y[MAX_SAMPLES], slopes[3];
+            const int windows[3] = { MAX_SAMPLES / 4, MAX_SAMPLES / 2, MAX_SAMPLES };
+            SamplesToColumns(samples, n, t, y);
+            GetRegressionKernels().MultiWindowSlopes(t, y, n, windows, 3, slopes);
+            TCHAR rates[128];
+            StringCchPrintf(rates, _countof(rates), _T("Rate (last %d/%d/%d): %.1f/%.1f/%.1f %%/h\n"),
+                windows[0], windows[1], windows[2], slopes[0], slopes[1], slopes[2]);
+            _tcscat_s(buf, _countof(buf), rates);
+
+            TCHAR filtered[96];
+            StringCchPrintf(filtered, _countof(filtered), _T("Filtered: %u dropped, %u repaired\n"),
+                sampleFilter.rejected, sampleFilter.repaired);
+            _tcscat_s(buf, _countof(buf), filtered);
+
             TCHAR dbg[256];
             _stprintf_s(dbg, _T("Oldest: %d%% @ %I64d\nNewest: %d%% @ %I64d"),
                 samples[0].percent, (LONGLONG)samples[0].t,
@@ -849,16 +2724,130 @@ void ShowBatteryDetails(HWND parent) {
 
     StringCchCat(buf, _countof(buf), wearbuf);
 
+    BatteryTelemetry telemetry;
+    if (ReadBatteryTelemetry(&telemetry)) {
+        TCHAR telbuf[320];
+        FormatTelemetry(telemetry, telbuf, _countof(telbuf));
+        StringCchCat(buf, _countof(buf), telbuf);
+    }
+
+    BatteryDB db;
+    if (LoadBatteryDB(&db)) {
+        // On AC the session closed at plug-in; show the one that just ended.
+        const EnergyLedger& e = db.energy;
+        bool inSession = e.session.start != 0;
+        TCHAR energybuf[160];
+        StringCchPrintf(energybuf, _countof(energybuf),
+            _T("Energy on battery: %s %.2f Wh, today %.2f Wh, week %.2f Wh\n"),
+            inSession ? _T("session") : _T("last session"),
+            (inSession ? e.session : e.lastSession).milliWattHours / 1000.0,
+            CurrentPeriodWattHours(e.day, LocalDayStart, time(NULL)),
+            CurrentPeriodWattHours(e.week, LocalWeekStart, time(NULL)));
+        StringCchCat(buf, _countof(buf), energybuf);
+
+        TCHAR cyclebuf[128];
+        StringCchPrintf(cyclebuf, _countof(cyclebuf), _T("Equivalent Cycles: %.1f\n"), db.wear.cycles);
+        StringCchCat(buf, _countof(buf), cyclebuf);
+        time_t replaceDate;
+        if (ProjectReplacement(db.wear, GetConfig().replaceAtPercent, time(NULL), &replaceDate)) {
+            struct tm lt;
+            localtime_s(&lt, &replaceDate);
+            TCHAR datebuf[32];
+            _tcsftime(datebuf, _countof(datebuf), _T("%Y-%m-%d"), &lt);
+            StringCchPrintf(cyclebuf, _countof(cyclebuf), _T("Replace at %d%%: %s\n"), GetConfig().replaceAtPercent, datebuf);
+            StringCchCat(buf, _countof(buf), cyclebuf);
+        }
+    }
+
     MessageBox(parent, buf, _T("Battery Details"), MB_OK | MB_ICONINFORMATION);
     SetForegroundWindow(parent);
 }
 
+void GetExportPath(TCHAR* path, const TCHAR* name) {
+    GetModuleFileName(NULL, path, MAX_PATH);
+    TCHAR* p = _tcsrchr(path, _T('\\'));
+    if (p) *(p + 1) = 0;
+    _tcscat_s(path, MAX_PATH, name);
+}
+
+// One row summarizing wear for fleet collection: cycles, capacities and the
+// projected replacement date (empty when there is no trend yet).
+void ExportWearCsv(const TCHAR* path) {
+    BatteryDB db;
+    LoadBatteryDB(&db);
+    const WearLedger& w = db.wear;
+    FILE* f;
+    _tfopen_s(&f, path, _T("w"));
+    if (!f) return;
+    int replaceAt = GetConfig().replaceAtPercent;
+    _ftprintf(f, _T("cycles,full_mwh,design_mwh,wear_pct,replace_at_pct,replace_date\n"));
+    double wear = w.designMilliWattHours > 0 ? 100.0 * (1.0 - (double)w.fullMilliWattHours / w.designMilliWattHours) : 0.0;
+    _ftprintf(f, _T("%.2f,%d,%d,%.1f,%d,"), w.cycles, w.fullMilliWattHours, w.designMilliWattHours, wear, replaceAt);
+    time_t replaceDate;
+    if (ProjectReplacement(w, replaceAt, time(NULL), &replaceDate)) {
+        struct tm lt;
+        localtime_s(&lt, &replaceDate);
+        TCHAR datebuf[32];
+        _tcsftime(datebuf, _countof(datebuf), _T("%Y-%m-%d"), &lt);
+        _ftprintf(f, _T("%s"), datebuf);
+    }
+    _ftprintf(f, _T("\n"));
+    fclose(f);
+}
+
+// Writes both history rings to History.csv next to the executable, and the
+// wear summary to Wear.csv. Telemetry columns are left empty when the driver
+// did not report the field.
+void ExportHistoryCsv(HWND parent) {
+    TCHAR csvPath[MAX_PATH], wearPath[MAX_PATH];
+    GetExportPath(csvPath, _T("History.csv"));
+    GetExportPath(wearPath, _T("Wear.csv"));
+
+    FILE* f;
+    _tfopen_s(&f, csvPath, _T("w"));
+    if (!f) {
+        MessageBox(parent, _T("Could not write History.csv"), _T("Export History"), MB_OK | MB_ICONERROR);
+        return;
+    }
+    _ftprintf(f, _T("time,ac,percent,rate,milliwatts,flag,millivolts,milliamps,temp_c,cycles,charge_mwh,full_mwh,design_mwh\n"));
+    for (int ac = 0; ac <= 1; ++ac) {
+        BatterySample samples[MAX_SAMPLES];
+        BatteryTelemetry telemetry[MAX_SAMPLES];
+        int n = ReadBatteryHistory(ac, samples, MAX_SAMPLES, telemetry);
+        for (int i = 0; i < n; ++i) {
+            const BatterySample& s = samples[i];
+            const BatteryTelemetry& t = telemetry[i];
+            _ftprintf(f, _T("%I64d,%d,%d,%d,%d,%d"), (LONGLONG)s.t, s.ac, s.percent, s.rate, s.milliWatts, s.flag);
+            const int fields[] = { TELEMETRY_VOLTAGE, TELEMETRY_CURRENT, TELEMETRY_TEMP, TELEMETRY_CYCLES,
+                TELEMETRY_CHARGE, TELEMETRY_FULL, TELEMETRY_DESIGN };
+            const int values[] = { t.milliVolts, t.milliAmps, t.deciCelsius, t.cycleCount,
+                t.chargeMilliWattHours, t.fullMilliWattHours, t.designMilliWattHours };
+            for (int k = 0; k < _countof(fields); ++k) {
+                if (!(t.present & fields[k]))
+                    _ftprintf(f, _T(","));
+                else if (fields[k] == TELEMETRY_TEMP)
+                    _ftprintf(f, _T(",%.1f"), values[k] / 10.0);
+                else
+                    _ftprintf(f, _T(",%d"), values[k]);
+            }
+            _ftprintf(f, _T("\n"));
+        }
+    }
+    fclose(f);
+    ExportWearCsv(wearPath);
+
+    TCHAR msg[2 * MAX_PATH + 32];
+    StringCchPrintf(msg, _countof(msg), _T("History exported to\n%s\n%s"), csvPath, wearPath);
+    MessageBox(parent, msg, _T("Export History"), MB_OK | MB_ICONINFORMATION);
+}
+
 void ShowTrayMenu(HWND hwnd) {
     POINT pt;
     GetCursorPos(&pt);
     HMENU hMenu = CreatePopupMenu();
     AppendMenu(hMenu, MF_STRING | (toolbarVisible ? MF_CHECKED : 0), IDM_SHOW_TOOLBAR, _T("Show Toolbar"));
     AppendMenu(hMenu, MF_STRING | (IsAutoStartEnabled() ? MF_CHECKED : 0), IDM_AUTOSTART, _T("Auto start"));
+    AppendMenu(hMenu, MF_STRING, IDM_EXPORT, _T("Export History"));
     AppendMenu(hMenu, MF_SEPARATOR, 0, NULL);
     AppendMenu(hMenu, MF_STRING, IDM_EXIT, _T("Exit"));
     SetForegroundWindow(hwnd);
@@ -867,7 +2856,7 @@ void ShowTrayMenu(HWND hwnd) {
 
     switch (cmd) {
     case IDM_EXIT:
-        PostQuitMessage(0);
+        DestroyWindow(hwnd);
         break;
     case IDM_SHOW_TOOLBAR:
         if (toolbarVisible) {
@@ -883,12 +2872,16 @@ void ShowTrayMenu(HWND hwnd) {
         else
             SetAutoStart(true);
         break;
+    case IDM_EXPORT:
+        ExportHistoryCsv(hwnd);
+        break;
     }
 }
 
 LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
     switch (msg) {
     case WM_CREATE: {
+        LoadCheckpoint();
         INITCOMMONCONTROLSEX icc = { sizeof(icc), ICC_WIN95_CLASSES };
         InitCommonControlsEx(&icc);
 
@@ -901,18 +2894,47 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
         StringCchCopy(nid.szTip, _countof(nid.szTip), _T("Battery Status"));
         Shell_NotifyIcon(NIM_ADD, &nid);
 
-        SetTimer(hwnd, IDT_TIMER, 30000, NULL);
-        UpdateTrayIcon();
+        SetTimer(hwnd, IDT_SAMPLE, GetConfig().sampleIntervalMs, NULL);
+        SetTimer(hwnd, IDT_CHECKPOINT, CHECKPOINT_INTERVAL, NULL);
+        StartConfigWatch(hwnd);
+        RegisterBatteryNotification(hwnd);
+        OpenLiveSegment();
+        SampleBattery();
 
         if (LoadToolbarVisible())
             ShowToolbar(hwnd);
         break;
     }
     case WM_TIMER:
-        if (wParam == IDT_TIMER) {
-            UpdateTrayIcon();
-            if (toolbarVisible && hToolbarWnd)
-                InvalidateRect(hToolbarWnd, NULL, FALSE);
+        if (wParam == IDT_SAMPLE) {
+            SampleBattery();
+        }
+        else if (wParam == IDT_CONFIG_SAVE) {
+            FlushConfig();
+        }
+        else if (wParam == IDT_CHECKPOINT) {
+            SaveCheckpoint();
+        }
+        break;
+    case WM_DEVICECHANGE:
+        // Top-level windows also get volume broadcasts; only batteries matter.
+        if ((wParam == DBT_DEVICEARRIVAL || wParam == DBT_DEVICEREMOVECOMPLETE) && lParam &&
+            ((DEV_BROADCAST_HDR*)lParam)->dbch_devicetype == DBT_DEVTYP_DEVICEINTERFACE &&
+            IsEqualGUID(((DEV_BROADCAST_DEVICEINTERFACE*)lParam)->dbcc_classguid, GUID_DEVCLASS_BATTERY)) {
+            CloseBatteryDevice();
+            if (wParam == DBT_DEVICEARRIVAL)
+                batteryMissing = false;
+        }
+        return TRUE;
+    case WM_CONFIGCHANGED:
+        if (ReloadConfigIfChanged()) {
+            SetTimer(hwnd, IDT_SAMPLE, config.sampleIntervalMs, NULL);
+            if (hToolbarWnd && toolbarVisible && !dragging)
+                SetWindowPos(hToolbarWnd, HWND_TOPMOST, config.toolbarX, config.toolbarY, 0, 0, SWP_NOSIZE | SWP_NOACTIVATE);
+            if (config.toolbarVisible && !toolbarVisible)
+                ShowToolbar(hwnd);
+            else if (!config.toolbarVisible && toolbarVisible && !dragging)
+                HideToolbar();
         }
         break;
     case WM_TRAYICON:
@@ -923,10 +2945,24 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
             ShowTrayMenu(hwnd);
         }
         break;
+    case WM_ENDSESSION:
+        // Logoff and shutdown end the process after this returns, usually
+        // without WM_DESTROY; save what WM_DESTROY would.
+        if (wParam) {
+            FlushConfig();
+            SaveCheckpoint();
+        }
+        break;
     case WM_DESTROY:
         Shell_NotifyIcon(NIM_DELETE, &nid);
         if (hToolbarWnd) DestroyWindow(hToolbarWnd);
         if (hTooltip) DestroyWindow(hTooltip);
+        CloseLiveSegment();
+        FlushConfig();
+        SaveCheckpoint();
+        FreeSpriteCache();
+        if (hBatteryNotify) UnregisterDeviceNotification(hBatteryNotify);
+        CloseBatteryDevice();
         PostQuitMessage(0);
         break;
     default:
@@ -935,7 +2971,573 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
     return 0;
 }
 
-int APIENTRY _tWinMain(HINSTANCE hInstance, HINSTANCE, LPTSTR, int) {
+// --- Self Test ---
+// "BatteryStatus.exe /selftest" checks the estimator building blocks against
+// reference results and replayed traces, and prints what they cost. Nothing
+// here touches the user's History.bin, the INI or the window.
+int selfTestFailures = 0;
+
+void SelfTestCheck(bool ok, const TCHAR* what) {
+    _tprintf(_T("%s %s\n"), ok ? _T("ok  ") : _T("FAIL"), what);
+    if (!ok) ++selfTestFailures;
+}
+
+double SelfTestSeconds(const LARGE_INTEGER& start) {
+    LARGE_INTEGER end, freq;
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&freq);
+    return (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+}
+
+// Equal within a relative tolerance; NaN only matches NaN.
+bool SelfTestNear(double a, double b, double tolerance) {
+    if (a != a || b != b) return a != a && b != b;
+    return fabs(a - b) <= tolerance * (std::max)(1.0, fabs(b));
+}
+
+// Times each kernel of one table over the test columns; returns a checksum so
+// the calls are not optimized away.
+double BenchmarkKernels(const TCHAR* name, const RegressionKernels& k,
+    const double* t, const double* y, const double* w, int n, int pairN, double* scratch) {
+    const int windows[3] = { 64, 512, n };
+    double sink = 0.0, slopes[3];
+    LARGE_INTEGER start;
+
+    QueryPerformanceCounter(&start);
+    const int reps = 2000;
+    for (int r = 0; r < reps; ++r)
+        sink += k.WeightedSlope(t, y, w, n);
+    double weighted = reps * (double)n / SelfTestSeconds(start);
+
+    QueryPerformanceCounter(&start);
+    for (int r = 0; r < reps; ++r) {
+        k.MultiWindowSlopes(t, y, n, windows, 3, slopes);
+        sink += slopes[2];
+    }
+    double multi = reps * (double)n / SelfTestSeconds(start);
+
+    QueryPerformanceCounter(&start);
+    const int pairReps = 50;
+    for (int r = 0; r < pairReps; ++r) {
+        k.PairwiseSlopes(t, y, pairN, scratch);
+        sink += scratch[r];
+    }
+    double pairs = pairReps * (pairN * (pairN - 1) / 2.0) / SelfTestSeconds(start);
+
+    _tprintf(_T("     %s: weighted %.0f M samples/s, windows %.0f M samples/s, pairwise %.0f M pairs/s\n"),
+        name, weighted / 1e6, multi / 1e6, pairs / 1e6);
+    return sink;
+}
+
+void SelfTestRegression() {
+    const int n = 4096, pairN = 512;
+    std::vector<double> t(n), y(n), w(n), ref(pairN * (pairN - 1) / 2), got(ref.size());
+    srand(26);
+    double hours = 0.0;
+    for (int i = 0; i < n; ++i) {
+        // Uneven 1-120 s steps with a few repeats, so short pairs hit the NaN path.
+        hours += (rand() % 121) / 3600.0;
+        t[i] = hours;
+        y[i] = 100.0 - 7.5 * hours + (rand() % 1000) / 250.0;
+        w[i] = 1.0 + (double)i / n;
+    }
+
+    double slope = scalarKernels.WeightedSlope(t.data(), y.data(), NULL, n);
+    SelfTestCheck(fabs(slope + 7.5) < 0.1, _T("scalar slope recovers the trend"));
+
+#if defined(_M_X64) || defined(_M_IX86)
+    if (CpuHasAvx()) {
+        SelfTestCheck(SelfTestNear(avxKernels.WeightedSlope(t.data(), y.data(), w.data(), n),
+            scalarKernels.WeightedSlope(t.data(), y.data(), w.data(), n), 1e-9), _T("AVX weighted slope matches scalar"));
+
+        bool same = true;
+        for (int len = 2; len <= 9; ++len) {
+            // Lengths around the vector width exercise the scalar tails.
+            same = same && SelfTestNear(avxKernels.WeightedSlope(t.data(), y.data(), NULL, len),
+                scalarKernels.WeightedSlope(t.data(), y.data(), NULL, len), 1e-9);
+        }
+        SelfTestCheck(same, _T("AVX slope matches scalar on short columns"));
+
+        const int windows[4] = { 3, 64, 513, n };
+        double a[4], b[4];
+        avxKernels.MultiWindowSlopes(t.data(), y.data(), n, windows, 4, a);
+        scalarKernels.MultiWindowSlopes(t.data(), y.data(), n, windows, 4, b);
+        same = true;
+        for (int i = 0; i < 4; ++i)
+            same = same && SelfTestNear(a[i], b[i], 1e-9);
+        SelfTestCheck(same, _T("AVX window slopes match scalar"));
+
+        same = true;
+        for (int m = pairN - 3; m <= pairN; ++m) {
+            avxKernels.PairwiseSlopes(t.data(), y.data(), m, got.data());
+            scalarKernels.PairwiseSlopes(t.data(), y.data(), m, ref.data());
+            for (int i = 0; i < m * (m - 1) / 2; ++i)
+                same = same && SelfTestNear(got[i], ref[i], 1e-12);
+        }
+        SelfTestCheck(same, _T("AVX pairwise slopes match scalar"));
+    }
+    else {
+        _tprintf(_T("     AVX not available, scalar kernels only\n"));
+    }
+#endif
+
+    double sink = BenchmarkKernels(_T("scalar"), scalarKernels, t.data(), y.data(), w.data(), n, pairN, ref.data());
+#if defined(_M_X64) || defined(_M_IX86)
+    if (CpuHasAvx())
+        sink += BenchmarkKernels(_T("AVX"), avxKernels, t.data(), y.data(), w.data(), n, pairN, got.data());
+#endif
+    if (sink == 0.0) _tprintf(_T("\n"));
+}
+
+// Minutes per percent of a simulated pack: constant current up to 80%, then a
+// constant-voltage taper.
+double SimulatedChargeMinutes(int percent) {
+    return percent < 80 ? 1.0 : 1.0 + (percent - 79) * 0.35;
+}
+
+// Samples a simulated charge from startPercent to full every 30 s; speed
+// scales the charger so sessions differ.
+int SimulateChargeTrace(int startPercent, double speed, time_t t0, BatterySample* out, int maxSamples) {
+    double charge = startPercent;
+    time_t t = t0;
+    int n = 0;
+    while (n < maxSamples) {
+        BatterySample s = { 0 };
+        s.percent = (std::min)(100, (int)charge);
+        s.ac = 1;
+        s.t = t;
+        out[n++] = s;
+        if (s.percent >= 100) break;
+        charge += 0.5 * speed / SimulatedChargeMinutes((int)charge);
+        t += 30;
+    }
+    return n;
+}
+
+// Trains the curve on replayed charge sessions and scores time to full on a
+// held-out session against the linear estimate it replaces.
+void SelfTestChargeCurve() {
+    std::vector<BatterySample> trace(1000);
+    ChargeCurve curve = { 0 };
+    SelfTestCheck(CurveTimeToFull(curve, 50, 1.0) < 0, _T("untrained curve gives no time to full"));
+
+    time_t t = 1700000000;
+    const int starts[] = { 20, 45, 60 };
+    const double speeds[] = { 0.9, 1.15, 1.0 };
+    for (int i = 0; i < _countof(starts); ++i) {
+        int n = SimulateChargeTrace(starts[i], speeds[i], t, trace.data(), (int)trace.size());
+        for (int k = 0; k < n; ++k)
+            UpdateChargeCurve(curve, trace[k]);
+        t = trace[n - 1].t + 3600;  // unplugged for an hour between sessions
+    }
+
+    int n = SimulateChargeTrace(30, 0.95, t, trace.data(), (int)trace.size());
+    double curveError = 0.0, linearError = 0.0;
+    int points = 0;
+    for (int i = 1; i < n; ++i) {
+        if (trace[i].percent == trace[i - 1].percent || trace[i].percent >= 100) continue;
+        double actual = difftime(trace[n - 1].t, trace[i].t);
+        double perMinute = (trace[i].percent - trace[0].percent) / (difftime(trace[i].t, trace[0].t) / 60.0);
+        double linear = (100 - trace[i].percent) / perMinute * 60.0;
+        double learned = CurveTimeToFull(curve, trace[i].percent, 1.0 / perMinute);
+        curveError += fabs(learned - actual);
+        linearError += fabs(linear - actual);
+        ++points;
+    }
+    curveError /= points * 60.0;
+    linearError /= points * 60.0;
+    _tprintf(_T("     time to full over %d points: curve off by %.1f min, linear by %.1f min\n"),
+        points, curveError, linearError);
+    SelfTestCheck(curveError < linearError / 4, _T("learned curve beats linear time to full"));
+}
+
+// Checks hysteresis on one rule, then times evaluation with thousands of rules
+// of every type configured. Rules get no actions, so nothing fires for real.
+void SelfTestAlertRules() {
+    std::vector<AlertRule> configured;
+    configured.swap(alertRules);
+    alertRulesLoaded = true;
+
+    AlertRule low = { 0 };
+    low.metric = METRIC_PERCENT;
+    low.type = ALERT_BELOW;
+    low.threshold = 10;
+    low.clear = 12;
+    low.window = 1;
+    alertRules.push_back(low);
+    const int percents[] = { 15, 10, 11, 13, 9 };
+    const bool expected[] = { false, true, true, false, true };
+    bool hysteresis = true;
+    BatterySample s = { 0 };
+    s.t = 1700000000;
+    for (int i = 0; i < _countof(percents); ++i) {
+        s.percent = percents[i];
+        s.t += 3;
+        EvaluateAlertRules(s, NAN);
+        hysteresis = hysteresis && alertRules[0].active == expected[i];
+    }
+    SelfTestCheck(hysteresis, _T("threshold rule fires once and re-arms past its clear level"));
+
+    AlertRule added = low;
+    added.threshold = 20;
+    std::vector<AlertRule> reloaded = { added, low };
+    CarryAlertState(reloaded, alertRules);
+    SelfTestCheck(reloaded[1].active && reloaded[1].seen == _countof(percents) && reloaded[0].seen == 0,
+        _T("reload keeps the state of unchanged rules only"));
+
+    const int ruleCount = 5000, sampleCount = 2000;
+    alertRules.assign(ruleCount, low);
+    for (int i = 0; i < ruleCount; ++i) {
+        AlertRule& r = alertRules[i];
+        r.metric = i % METRIC_COUNT;
+        r.type = i % _countof(alertTypeNames);
+        r.threshold = r.clear = 5 + i % 50;
+        r.window = 1 + i % 30;
+    }
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    for (int k = 0; k < sampleCount; ++k) {
+        s.percent = 90 - k * 80 / sampleCount;
+        s.milliWatts = 9000 + (k % 7) * 300;
+        s.t += 3;
+        EvaluateAlertRules(s, 30.0 + (k % 5) * 0.5);
+    }
+    double seconds = SelfTestSeconds(start);
+    _tprintf(_T("     %d rules x %d samples: %.1f ns per rule, %.1f us per sample\n"),
+        ruleCount, sampleCount, seconds * 1e9 / ((double)ruleCount * sampleCount), seconds * 1e6 / sampleCount);
+
+    alertRules.swap(configured);
+}
+
+// Replays a power ramp from w0 to w1 watts sampled every 3 s; returns the
+// time of the last sample.
+time_t ReplayPowerTrace(EnergyLedger& e, time_t t0, int seconds, int ac, double w0, double w1) {
+    BatterySample s = { 0 };
+    s.percent = 50;
+    s.ac = ac;
+    for (int dt = 0; dt <= seconds; dt += 3) {
+        s.t = t0 + dt;
+        s.milliWatts = (int)((w0 + (w1 - w0) * dt / seconds) * 1000.0 + 0.5);
+        UpdateEnergyLedger(e, s);
+    }
+    return t0 + seconds;
+}
+
+// Integrates synthetic traces whose energy is known in closed form.
+void SelfTestEnergyLedger() {
+    EnergyLedger e = { 0 };
+    time_t midnight = LocalDayStart(1700000000) + 24 * 3600;
+    time_t t = ReplayPowerTrace(e, midnight - 2 * 3600, 4 * 3600, 0, 10, 10);
+    SelfTestCheck(SelfTestNear(e.session.milliWattHours, 40000, 1e-6), _T("4 h at 10 W integrates to 40 Wh"));
+    SelfTestCheck(SelfTestNear(e.lastDay.milliWattHours, 20000, 1e-6) && SelfTestNear(e.day.milliWattHours, 20000, 1e-6),
+        _T("midnight splits the day rollup"));
+
+    t = ReplayPowerTrace(e, t, 3600, 0, 5, 15);
+    SelfTestCheck(SelfTestNear(e.session.milliWattHours, 50000, 1e-4), _T("1 h ramp from 5 to 15 W adds 10 Wh"));
+
+    t = ReplayPowerTrace(e, t + 1200, 600, 0, 12, 12);
+    SelfTestCheck(SelfTestNear(e.session.milliWattHours, 52000, 1e-4) && SelfTestNear(e.session.gapSeconds, 1200, 1e-9),
+        _T("20 min without samples is a gap, not energy"));
+
+    t = ReplayPowerTrace(e, t, 3600, 1, 20, 20);
+    SelfTestCheck(e.session.start == 0 && SelfTestNear(e.lastSession.milliWattHours, 52000, 1e-4),
+        _T("plugging in closes the session"));
+
+    t = ReplayPowerTrace(e, t, 1800, 0, 8, 8);
+    SelfTestCheck(SelfTestNear(e.session.milliWattHours, 4000, 1e-4), _T("unplugging starts a new session"));
+    SelfTestCheck(SelfTestNear(CurrentPeriodWattHours(e.day, LocalDayStart, t), 36.0, 1e-4),
+        _T("today excludes time on AC"));
+}
+
+// Writes every sprite variant of one size as a 32-bit top-down BMP: one column
+// per percent, one row per charging/low combination.
+bool WriteSpriteSheet(const TCHAR* path, int size) {
+    int width = SPRITE_LEVELS * size, height = 4 * size;
+    std::vector<DWORD> sheet(width * height), px(size * size);
+    for (int p = 0; p < SPRITE_LEVELS; ++p) {
+        for (int v = 0; v < 4; ++v) {
+            RenderBatterySprite(px.data(), size, p, (v & 1) != 0, (v & 2) != 0);
+            for (int y = 0; y < size; ++y)
+                memcpy(&sheet[(v * size + y) * width + p * size], &px[y * size], size * sizeof(DWORD));
+        }
+    }
+    BITMAPFILEHEADER bf = { 0 };
+    BITMAPINFOHEADER bi = { 0 };
+    bi.biSize = sizeof(bi);
+    bi.biWidth = width;
+    bi.biHeight = -height;
+    bi.biPlanes = 1;
+    bi.biBitCount = 32;
+    bi.biCompression = BI_RGB;
+    bf.bfType = 0x4D42;
+    bf.bfOffBits = sizeof(bf) + sizeof(bi);
+    bf.bfSize = bf.bfOffBits + (DWORD)(sheet.size() * sizeof(DWORD));
+    FILE* f;
+    _tfopen_s(&f, path, _T("wb"));
+    if (!f) return false;
+    fwrite(&bf, sizeof(bf), 1, f);
+    fwrite(&bi, sizeof(bi), 1, f);
+    fwrite(sheet.data(), sizeof(DWORD), sheet.size(), f);
+    fclose(f);
+    return true;
+}
+
+// Renders sprites without a device context and checks their pixels, then
+// compares a cached tray update with drawing the icon on demand.
+void SelfTestSprites() {
+    const int sizes[] = { 16, 20, 24, 32 };
+    bool transparent = true, fillMatches = true, colors = true;
+    for (int size : sizes) {
+        std::vector<DWORD> px(size * size);
+        double k = size / 16.0;
+        int bodyTop = (int)(3 * k + 0.5), margin = (int)(2 * k + 0.5);
+        int fillable = size - 1 - bodyTop - 2 * margin;
+        for (int p = 0; p <= 100; p += 5) {
+            for (int v = 0; v < 4; ++v) {
+                bool charging = (v & 1) != 0, low = (v & 2) != 0;
+                RenderBatterySprite(px.data(), size, p, charging, low);
+                transparent = transparent && px[0] >> 24 == 0 && px[size * size - 1] >> 24 == 0;
+
+                DWORD fill = low ? SPRITE_ARGB(255, 64, 64) : charging ? SPRITE_ARGB(128, 255, 128) : SPRITE_ARGB(255, 255, 128);
+                int rows = 0;
+                for (int y = 0; y < size; ++y)
+                    if (px[y * size + margin] == fill) ++rows;
+                fillMatches = fillMatches && rows == fillable * p / 100;
+
+                bool bolt = std::find(px.begin(), px.end(), SPRITE_ARGB(0, 192, 0)) != px.end();
+                colors = colors && bolt == charging;
+            }
+        }
+    }
+    SelfTestCheck(transparent, _T("sprites are transparent outside the battery"));
+    SelfTestCheck(fillMatches, _T("sprite fill height follows percent at every size"));
+    SelfTestCheck(colors, _T("charging sprites, and only those, draw the bolt"));
+
+    TCHAR sheetPath[MAX_PATH];
+    GetExportPath(sheetPath, _T("SelfTestSprites.bmp"));
+    if (WriteSpriteSheet(sheetPath, GetSystemMetrics(SM_CXSMICON)))
+        _tprintf(_T("     sprite sheet written to %s\n"), sheetPath);
+
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    GetBatterySpriteIcon(50, false, false);
+    double build = SelfTestSeconds(start);
+
+    const int cachedUpdates = 100000, drawnUpdates = 2000;
+    HICON sink = NULL;
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < cachedUpdates; ++i)
+        sink = GetBatterySpriteIcon(i % SPRITE_LEVELS, (i & 1) != 0, false);
+    double cached = SelfTestSeconds(start) / cachedUpdates;
+
+    int size = GetSystemMetrics(SM_CXSMICON);
+    std::vector<DWORD> px(size * size);
+    QueryPerformanceCounter(&start);
+    for (int i = 0; i < drawnUpdates; ++i) {
+        RenderBatterySprite(px.data(), size, i % SPRITE_LEVELS, (i & 1) != 0, false);
+        HICON hIcon = CreateIconFromSprite(px.data(), size);
+        if (hIcon) DestroyIcon(hIcon);
+    }
+    double drawn = SelfTestSeconds(start) / drawnUpdates;
+    _tprintf(_T("     tray icon update: cached %.3f us, drawn on demand %.1f us (cache built once in %.1f ms)\n"),
+        cached * 1e6, drawn * 1e6, build * 1e3);
+    SelfTestCheck(sink != NULL, _T("sprite cache returns icons"));
+    FreeSpriteCache();
+}
+
+// Minutes left from a window of history, the way EstimateTimeFromHistory
+// computes it; -1 without a usable fit.
+double ReplayMinutesLeft(const std::vector<BatterySample>& window, int percent) {
+    double rate = 0.0;
+    if (window.size() < 2 || !FitHistoryRate(window.data(), (int)window.size(), &rate) || rate >= 0)
+        return -1;
+    return percent * 60.0 / -rate;
+}
+
+// Replays a steady discharge with injected firmware glitches next to its clean
+// twin, and checks that after filtering the estimate barely moves.
+void SelfTestSampleFilter() {
+    SampleFilter f = { 0 };
+    std::vector<BatterySample> clean, filtered, raw;
+    int shown = 0;
+    double worstFiltered = 0.0, worstRaw = 0.0;
+    time_t t0 = 1700000000;
+    for (int k = 0; k < 240; ++k) {
+        BatterySample s = { 0 };
+        s.percent = 90 - k / 6;  // 20 %/h at one sample every 30 s
+        s.milliWatts = 9000 + (k % 5) * 100;
+        s.t = t0 + k * 30;
+        BatterySample g = s;
+        if (k == 60) g.percent = 12;                // one-tick drop and back
+        if (k == 100) g.milliWatts = 0;             // Rate 0x80000000 read as 0
+        if (k == 130) g.milliWatts = 60000;         // power spike
+        if (k == 170) g.percent = s.percent + 30;   // phantom jump up
+
+        const size_t keep = MAX_SAMPLES;
+        clean.push_back(s);
+        raw.push_back(g);
+        BatterySample fs = g;
+        if (FilterBatterySample(f, fs)) {
+            filtered.push_back(fs);
+            shown = fs.percent;
+        }
+        if (clean.size() > keep) clean.erase(clean.begin());
+        if (raw.size() > keep) raw.erase(raw.begin());
+        if (filtered.size() > keep) filtered.erase(filtered.begin());
+        if (k < 20) continue;
+
+        double reference = ReplayMinutesLeft(clean, s.percent);
+        double a = ReplayMinutesLeft(filtered, shown), b = ReplayMinutesLeft(raw, g.percent);
+        worstFiltered = (std::max)(worstFiltered, a < 0 ? 1.0 : fabs(a - reference) / reference);
+        worstRaw = (std::max)(worstRaw, b < 0 ? 1.0 : fabs(b - reference) / reference);
+    }
+    _tprintf(_T("     glitchy trace: %u dropped, %u repaired, worst estimate error %.1f%% filtered, %.1f%% unfiltered\n"),
+        f.rejected, f.repaired, worstFiltered * 100.0, worstRaw * 100.0);
+    SelfTestCheck(f.rejected == 2 && f.repaired == 2, _T("filter drops percent glitches and repairs power glitches"));
+    SelfTestCheck(worstFiltered < 0.05, _T("filtered estimate stays within 5% through glitches"));
+
+    // A genuine step, such as a recalibration, must survive the filter.
+    SampleFilter g = { 0 };
+    int accepted = 0;
+    for (int k = 0; k < 12; ++k) {
+        BatterySample s = { 0 };
+        s.percent = k < 4 ? 64 : 40;
+        s.milliWatts = 9000;
+        s.t = t0 + k * 30;
+        if (FilterBatterySample(g, s) && s.percent == 40) ++accepted;
+    }
+    SelfTestCheck(accepted >= 6, _T("filter lets a lasting step through"));
+}
+
+// Compares full telemetry snapshots over the persistent handle with opening
+// the device for every read, in OS calls and time per snapshot.
+void SelfTestTelemetryCost() {
+    BatteryTelemetry tel;
+    if (!ReadBatteryTelemetry(&tel)) {
+        _tprintf(_T("     no battery telemetry, snapshot cost not measured\n"));
+        return;
+    }
+    const int reads = 200;
+    persistentCost = reopenCost = TelemetryCost();
+    for (int i = 0; i < reads; ++i) {
+        ReadBatteryTelemetry(&tel);
+        ReadBatteryTelemetryReopen(&tel);
+    }
+    TCHAR line[96];
+    FormatTelemetryCost(_T("     persistent handle"), persistentCost, line, _countof(line));
+    _tprintf(_T("%s"), line);
+    FormatTelemetryCost(_T("     reopen per read"), reopenCost, line, _countof(line));
+    _tprintf(_T("%s"), line);
+    SelfTestCheck(persistentCost.calls < reopenCost.calls, _T("persistent handle makes fewer OS calls"));
+    CloseBatteryDevice();
+}
+
+// Forgets what a previous launch left in memory, as a new process would.
+void ResetEstimatorState() {
+    for (int ac = 0; ac < 2; ++ac) {
+        estimatorRate[ac] = 0;
+        estimatorRateT[ac] = 0;
+    }
+    dischargeSampleCount = chargeSampleCount = 0;
+    memset(&sampleFilter, 0, sizeof(sampleFilter));
+}
+
+// Times launch to first estimate against scratch copies of History.bin and
+// the checkpoint in %TEMP%. Warm: a fresh checkpoint and one new sample.
+// Cold: no checkpoint, so samples of a 12 %/h drain accumulate at the
+// configured interval until the history alone can be fitted.
+void SelfTestStartupLatency() {
+    TCHAR savedDb[MAX_PATH], savedCheckpoint[MAX_PATH], dir[MAX_PATH];
+    GetDbPath();
+    GetCheckpointPath();
+    _tcscpy_s(savedDb, dbPath);
+    _tcscpy_s(savedCheckpoint, checkpointPath);
+    GetTempPath(MAX_PATH, dir);
+    StringCchPrintf(dbPath, MAX_PATH, _T("%sBatteryStatusSelfTest.bin"), dir);
+    StringCchPrintf(checkpointPath, MAX_PATH, _T("%sBatteryStatusSelfTest.ckpt"), dir);
+
+    const int interval = GetConfig().sampleIntervalMs;
+    const double drainPerHour = 12.0;
+    time_t now = time(NULL);
+    BatteryDB db;
+    memset(&db, 0, sizeof(db));
+    BatterySample s = { 0 };
+    s.percent = 60;
+    s.flag = 1;
+    s.milliWatts = 8000;
+    s.rate = 8;
+    s.t = now;
+    db.discharge[db.idxDischarge++] = s;
+    SaveBatteryDB(&db);
+
+    ResetEstimatorState();
+    estimatorRate[0] = -drainPerHour;
+    estimatorRateT[0] = now - 60;
+    SaveCheckpoint();
+    ResetEstimatorState();
+
+    int rate = 0, count = 0;
+    LARGE_INTEGER start;
+    QueryPerformanceCounter(&start);
+    bool warmLoaded = LoadCheckpoint();
+    int warm = EstimateTimeFromHistory(0, s.percent, &rate, &count);
+    double warmMs = SelfTestSeconds(start) * 1000.0;
+    SelfTestCheck(warmLoaded && warm > 0, _T("warm start estimates from the first sample"));
+    SelfTestCheck(SelfTestNear(warm, s.percent * 3600.0 / drainPerHour, 0.01), _T("warm start uses the checkpointed rate"));
+
+    DeleteFile(checkpointPath);
+    ResetEstimatorState();
+    int samples = 1;
+    double coldSeconds = 0;
+    QueryPerformanceCounter(&start);
+    bool coldLoaded = LoadCheckpoint();
+    int cold = EstimateTimeFromHistory(0, s.percent, &rate, &count);
+    coldSeconds += SelfTestSeconds(start);
+    SelfTestCheck(!coldLoaded && cold < 0, _T("cold start has no estimate from one sample"));
+    while (cold < 0 && samples < 3600 * 1000 / interval) {
+        double elapsed = (double)samples * interval / 1000.0;
+        s.t = now + (time_t)elapsed;
+        s.percent = 60 - (int)(elapsed * drainPerHour / 3600.0);
+        db.discharge[db.idxDischarge] = s;
+        db.idxDischarge = (db.idxDischarge + 1) % MAX_SAMPLES;
+        ++samples;
+        QueryPerformanceCounter(&start);
+        SaveBatteryDB(&db);
+        cold = EstimateTimeFromHistory(0, s.percent, &rate, &count);
+        coldSeconds += SelfTestSeconds(start);
+    }
+    SelfTestCheck(cold > 0, _T("cold start estimates once the history can be fitted"));
+    _tprintf(_T("     warm start: first estimate %.2f ms after launch\n"), warmMs);
+    _tprintf(_T("     cold start: first estimate after %d samples, %.0f s at %d ms per sample (%.2f ms computing)\n"),
+        samples, (samples - 1) * interval / 1000.0, interval, coldSeconds * 1000.0);
+
+    DeleteFile(dbPath);
+    _tcscpy_s(dbPath, savedDb);
+    _tcscpy_s(checkpointPath, savedCheckpoint);
+    ResetEstimatorState();
+}
+
+// Handles "BatteryStatus.exe /selftest"; the exit code is the number of failures.
+int RunSelfTest() {
+    AttachOutputConsole();
+    SelfTestRegression();
+    SelfTestChargeCurve();
+    SelfTestAlertRules();
+    SelfTestEnergyLedger();
+    SelfTestSprites();
+    SelfTestSampleFilter();
+    SelfTestTelemetryCost();
+    SelfTestStartupLatency();
+    _tprintf(_T("%d check(s) failed\n"), selfTestFailures);
+    return selfTestFailures;
+}
+
+int APIENTRY _tWinMain(HINSTANCE hInstance, HINSTANCE, LPTSTR lpCmdLine, int) {
+    if (lpCmdLine && _tcsstr(lpCmdLine, _T("/status")))
+        return PrintLiveStatus();
+    if (lpCmdLine && _tcsstr(lpCmdLine, _T("/selftest")))
+        return RunSelfTest();
+
     hInst = hInstance;
     WNDCLASS wc = { 0 };
     wc.lpfnWndProc = WndProc;
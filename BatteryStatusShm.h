@@ -0,0 +1,68 @@
+#pragma once
+#include <windows.h>
+
+// Live battery status published by BatteryStatus.exe into a named
+// shared-memory segment. Consumers map it once with OpenBatteryLiveSegment
+// and copy snapshots with ReadBatteryLiveStatus; reads never block the writer.
+#define BATTERY_SHM_NAME    TEXT("Local\\BatteryStatusLive")
+#define BATTERY_SHM_VERSION 1
+
+struct BatteryLiveStatus {
+    int percent;
+    int acLineStatus;
+    int batteryFlag;
+    int charging;
+    int milliWatts;
+    int windowsTimeSec;     // -1 when unknown
+    int historyTimeSec;     // -1 when unknown
+    int wearTenths;         // wear in 0.1% units, -1 when unknown
+    int dischargeSamples;
+    int chargeSamples;
+    LONGLONG updated;       // time_t of the reading
+    ULONGLONG generation;   // incremented on every publish
+};
+
+struct BatteryLiveSegment {
+    DWORD version;
+    DWORD size;
+    volatile LONG sequence; // odd while the writer is updating status
+    BatteryLiveStatus status;
+};
+
+inline BatteryLiveSegment* OpenBatteryLiveSegment(HANDLE* outMapping) {
+    *outMapping = OpenFileMapping(FILE_MAP_READ, FALSE, BATTERY_SHM_NAME);
+    if (!*outMapping) return nullptr;
+    BatteryLiveSegment* seg = (BatteryLiveSegment*)MapViewOfFile(*outMapping, FILE_MAP_READ, 0, 0, sizeof(BatteryLiveSegment));
+    if (seg && (seg->version != BATTERY_SHM_VERSION || seg->size != sizeof(BatteryLiveSegment))) {
+        UnmapViewOfFile(seg);
+        seg = nullptr;
+    }
+    if (!seg) {
+        CloseHandle(*outMapping);
+        *outMapping = NULL;
+    }
+    return seg;
+}
+
+inline void CloseBatteryLiveSegment(BatteryLiveSegment* seg, HANDLE mapping) {
+    if (seg) UnmapViewOfFile(seg);
+    if (mapping) CloseHandle(mapping);
+}
+
+// Copies a consistent snapshot. Returns false if the writer never published
+// or kept the segment busy for every attempt.
+inline bool ReadBatteryLiveStatus(const BatteryLiveSegment* seg, BatteryLiveStatus* out) {
+    for (int attempt = 0; attempt < 1000; ++attempt) {
+        LONG before = seg->sequence;
+        if (before & 1) {
+            YieldProcessor();
+            continue;
+        }
+        MemoryBarrier();
+        *out = *(const BatteryLiveStatus*)&seg->status;
+        MemoryBarrier();
+        if (seg->sequence == before)
+            return out->generation != 0;
+    }
+    return false;
+}